@@ -0,0 +1,243 @@
+#include "allocator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+using std::lock_guard;
+using std::make_pair;
+using std::max;
+using std::min;
+using std::mutex;
+using std::prev;
+using std::vector;
+
+Allocator::Allocator(const uint num_blocks, const uint num_shards){
+    uint count = max(1U, min(num_shards, num_blocks));
+    shard_blocks = (num_blocks + count - 1) / count;
+
+    for(uint first = 0; first < num_blocks; first += shard_blocks){
+        shards.emplace_back(new Shard);
+        Shard &shard = *shards.back();
+        shard.first = first;
+        shard.end = min(first + shard_blocks, num_blocks);
+        shard.insert_run(shard.first, shard.end - shard.first);
+    }
+}
+
+//each thread starts looking in its own shard, handed out round robin as threads first allocate
+uint Allocator::home_shard() const{
+    static std::atomic<uint> next_home(0);
+    static thread_local uint home = next_home++;
+    return home % shards.size();
+}
+
+void Allocator::Shard::insert_run(uint start, uint length){
+    by_addr[start] = length;
+    by_size.insert(make_pair(length, start));
+    free_blocks += length;
+}
+
+void Allocator::Shard::erase_run(uint start, uint length){
+    by_addr.erase(start);
+    by_size.erase(make_pair(length, start));
+    free_blocks -= length;
+}
+
+//take up to count blocks from this shard and return how many were taken
+uint Allocator::Shard::take(uint count, vector<FreeNode> &runs){
+    uint taken_total = 0;
+    while(count > 0 && !by_size.empty()){
+        //smallest run that holds everything that is left, else the largest run there is
+        auto fit = by_size.lower_bound(make_pair(count, 0U));
+        if(fit == by_size.end()) fit = prev(by_size.end());
+
+        uint length = fit->first;
+        uint start = fit->second;
+        uint taken = min(length, count);
+
+        erase_run(start, length);
+        if(taken < length) insert_run(start + taken, length - taken);
+
+        runs.emplace_back(taken, start);
+        count -= taken;
+        taken_total += taken;
+    }
+    return taken_total;
+}
+
+//take count blocks from at on out of the free run starting at run_start, which holds them
+void Allocator::Shard::take_from(uint run_start, uint at, uint count, vector<FreeNode> &runs){
+    uint run_end = run_start + by_addr[run_start];
+    erase_run(run_start, run_end - run_start);
+    if(run_start < at) insert_run(run_start, at - run_start);
+    if(at + count < run_end) insert_run(at + count, run_end - at - count);
+    runs.emplace_back(count, at);
+}
+
+//Take blocks from goal on if they are free, as many as there are up to count; otherwise
+//all count blocks from the first of a few runs after goal that holds them. Returns how
+//many were taken.
+uint Allocator::Shard::take_near(uint goal, uint count, vector<FreeNode> &runs){
+    auto run = by_addr.upper_bound(goal);
+    if(run != by_addr.begin()){
+        auto at = prev(run);
+        if(at->first + at->second > goal){
+            uint taken = min(count, at->first + at->second - goal);
+            take_from(at->first, goal, taken, runs);
+            return taken;
+        }
+    }
+    for(uint looked = 0; run != by_addr.end() && looked < goal_search; ++run, looked++){
+        if(run->second >= count){
+            take_from(run->first, run->first, count, runs);
+            return count;
+        }
+    }
+    return 0;
+}
+
+//give a run back, merging it with the free runs directly before and after it
+void Allocator::Shard::release(uint start, uint count){
+    auto next = by_addr.lower_bound(start);
+    if(next != by_addr.begin()){
+        auto before = prev(next);
+        if(before->first + before->second == start){
+            start = before->first;
+            count += before->second;
+            erase_run(before->first, before->second);
+        }
+    }
+
+    next = by_addr.find(start + count);
+    if(next != by_addr.end()){
+        uint length = next->second;
+        erase_run(next->first, length);
+        count += length;
+    }
+
+    insert_run(start, count);
+}
+
+//cut [start, start + count) out of the free run holding it
+void Allocator::Shard::reserve(uint start, uint count){
+    auto run = by_addr.upper_bound(start);
+    if(run == by_addr.begin()) return;
+    run = prev(run);
+    uint run_start = run->first;
+    uint run_end = run->first + run->second;
+    if(start + count > run_end) return;
+
+    erase_run(run_start, run_end - run_start);
+    if(run_start < start) insert_run(run_start, start - run_start);
+    if(start + count < run_end) insert_run(start + count, run_end - start - count);
+}
+
+bool Allocator::allocate(uint count, vector<FreeNode> &runs, uint goal){
+    if(count == 0) return true;
+    uint n = shards.size();
+    size_t first_run = runs.size();
+    uint left = count;
+
+    //the goal's shard is searched first, whatever thread asks
+    uint home = home_shard();
+    if(goal != 0 && goal / shard_blocks < n){
+        home = goal / shard_blocks;
+        Shard &shard = *shards[home];
+        lock_guard<mutex> guard(shard.lock);
+        left -= shard.take_near(goal, left, runs);
+        if(left == 0) return true;
+    }
+
+    //prefer a shard that can hand out the whole request as one run
+    for(uint i = 0; i < n; i++){
+        Shard &shard = *shards[(home + i) % n];
+        lock_guard<mutex> guard(shard.lock);
+        if(!shard.by_size.empty() && shard.by_size.rbegin()->first >= left){
+            shard.take(left, runs);
+            return true;
+        }
+    }
+
+    //otherwise gather pieces, giving them back if there is not enough space in total
+    for(uint i = 0; i < n && left > 0; i++){
+        Shard &shard = *shards[(home + i) % n];
+        lock_guard<mutex> guard(shard.lock);
+        left -= shard.take(left, runs);
+    }
+    if(left > 0){
+        for(size_t r = first_run; r < runs.size(); r++){
+            release(runs[r].pos, runs[r].num_blocks);
+        }
+        runs.erase(runs.begin() + first_run, runs.end());
+        return false;
+    }
+    return true;
+}
+
+//a run can span shards when an inode merged runs across a boundary, so split it up
+void Allocator::release(uint start, uint count){
+    while(count > 0){
+        Shard &shard = *shards[start / shard_blocks];
+        uint piece = min(count, shard.end - start);
+        {
+            lock_guard<mutex> guard(shard.lock);
+            shard.release(start, piece);
+        }
+        start += piece;
+        count -= piece;
+    }
+}
+
+void Allocator::reserve(uint start, uint count){
+    while(count > 0){
+        Shard &shard = *shards[start / shard_blocks];
+        uint piece = min(count, shard.end - start);
+        {
+            lock_guard<mutex> guard(shard.lock);
+            shard.reserve(start, piece);
+        }
+        start += piece;
+        count -= piece;
+    }
+}
+
+void Allocator::free_runs(vector<FreeNode> &runs) const{
+    for(auto &sp : shards){
+        lock_guard<mutex> guard(sp->lock);
+        for(auto &run : sp->by_addr){
+            runs.emplace_back(run.second, run.first);
+        }
+    }
+}
+
+Allocator::Stats Allocator::stats() const{
+    Stats st = {0, 0, 0};
+    uint open_run = 0;      //length of a free run that reaches the end of the previous shard
+
+    for(auto &sp : shards){
+        Shard &shard = *sp;
+        lock_guard<mutex> guard(shard.lock);
+        st.free_blocks += shard.free_blocks;
+
+        for(auto &run : shard.by_addr){
+            uint length = run.second;
+            if(run.first == shard.first && open_run > 0){
+                length += open_run;
+            } else{
+                st.free_runs++;
+            }
+            st.largest_run = max(st.largest_run, length);
+            open_run = run.first + run.second == shard.end ? length : 0;
+        }
+        if(shard.by_addr.empty()) open_run = 0;
+    }
+    return st;
+}
+
+//0 when all free space is one run, approaching 1 as it splinters
+double Allocator::fragmentation() const{
+    Stats st = stats();
+    if(st.free_blocks == 0) return 0.0;
+    return 1.0 - static_cast<double>(st.largest_run) / st.free_blocks;
+}
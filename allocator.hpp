@@ -0,0 +1,76 @@
+/*
+The Allocator tracks the free space of the disk as runs of free blocks (FreeNodes).
+The disk is split into shards of consecutive blocks, each with its own lock, so
+threads allocating at the same time mostly work on different shards.
+Every free run in a shard is indexed twice:
+1. by address, so a freed run can be coalesced with its neighbours in O(log n)
+2. by size, so allocation is a best-fit lookup in O(log n)
+An allocation may name a goal block, where its data would continue what is already
+on disk (the end of a file's last run, its parent directory's blocks). The free run
+at the goal is used first, then the first run after it that holds the whole request.
+Block positions handed out and taken back are block numbers, not byte offsets.
+*/
+
+#ifndef _ALLOCATOR_H_
+#define _ALLOCATOR_H_
+
+#include "freeNode.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+class Allocator{
+        struct Shard{
+            std::mutex lock;
+            uint first;                                    //first block of the shard
+            uint end;                                      //one past its last block
+            std::map<uint, uint> by_addr;                  //start block -> run length
+            std::set<std::pair<uint, uint> > by_size;      //(run length, start block)
+            uint free_blocks = 0;
+
+            void insert_run(uint start, uint length);
+            void erase_run(uint start, uint length);
+            uint take(uint count, std::vector<FreeNode> &runs);
+            uint take_near(uint goal, uint count, std::vector<FreeNode> &runs);
+            void take_from(uint run_start, uint at, uint count, std::vector<FreeNode> &runs);
+            void release(uint start, uint count);
+            void reserve(uint start, uint count);
+        };
+
+        static const uint goal_search = 64;    //free runs after the goal looked at for a fit
+
+        std::vector<std::unique_ptr<Shard> > shards;
+        uint shard_blocks;
+
+        uint home_shard() const;
+
+    public:
+        struct Stats{
+            uint free_blocks;
+            uint free_runs;
+            uint largest_run;
+        };
+
+        Allocator(const uint num_blocks, const uint num_shards);
+
+        //Allocate count blocks: near goal if it is not 0, else best-fit when a single run is
+        //large enough and largest runs first otherwise. Nothing is allocated if count
+        //blocks are not free.
+        bool allocate(uint count, std::vector<FreeNode> &runs, uint goal = 0);
+        void release(uint start, uint count);
+        //take the free blocks [start, start + count) out of circulation, e.g. ones in use on a mounted image
+        void reserve(uint start, uint count);
+        //every free run in block order, for saving the free map
+        void free_runs(std::vector<FreeNode> &runs) const;
+
+        //runs that only touch because of a shard boundary are reported as one
+        Stats stats() const;
+        double fragmentation() const;
+};
+
+#endif
@@ -0,0 +1,450 @@
+/*
+Benchmarks for the filesystem. Each benchmark runs once per configuration and
+prints the wall clock time so configurations can be compared side by side.
+	1. device: random single block reads/writes straight against each BlockDevice
+	2. fs: sequential file writes and reads through FSImp with a small block cache
+	3. engine: files written in interleaved chunks, so their extents are scattered, then
+	   read back whole; large reads and writes go through io_uring or the thread pool
+	4. mount: an image holding many files is unmounted and mounted again, then one
+	   file deep in it is looked up; mounting must not read every inode
+	5. journal: mkdir and create (open, write, close; close waits for durability) rates
+	   with the journal off (close syncs the whole cache), committing every operation on
+	   its own, and with group commit, from one and from several threads
+	6. threads: worker threads copying, reading, stating and removing files in their
+	   own directories of one FSImp; throughput should grow with the thread count
+	7. buffering: two files grown by small appends in turn, with and without write
+	   buffering; buffered, each file is allocated in few large extents
+	8. readahead: a file much larger than the cache streamed through small reads, with
+	   reading ahead off and on, and how many of the blocks read ahead were used
+	9. geometry: the offset mapping of the read and write loops on its own, with 4 KiB
+	   blocks fixed at compile time (shifts and masks) and given at run time (divisions):
+	   byte positions to blocks, offsets and image positions, and byte ranges of a file
+	   in scattered one-block extents to image ranges
+	10. compound: files created and filled with open, several writes and close, as
+	   separate calls and as compounds of several files each, committed once per compound
+*/
+
+#include "fsImple.hpp"
+#include "blockDevice.hpp"
+#include "geometry.hpp"
+#include "inode.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::function;
+using std::max;
+using std::setw;
+using std::streambuf;
+using std::streamsize;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+const string IMAGE = "bench.img";
+const uint DISKSIZE = 100000000;
+const uint BLOCKSIZE = 1024;
+const uint CACHEBLOCKS = 64;
+
+const BlockDevice::Type DEVICES[] = {BlockDevice::posix_dev, BlockDevice::fstream_dev, BlockDevice::mmap_dev};
+
+const char *device_name(BlockDevice::Type type) {
+  if (type == BlockDevice::mmap_dev) return "mmap";
+  if (type == BlockDevice::fstream_dev) return "fstream";
+  return "posix";
+}
+
+//run fn and print how long it took in milliseconds
+void timed(const string &name, const string &config, function<void()> fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  auto end = std::chrono::steady_clock::now();
+  double ms = std::chrono::duration<double, std::milli>(end - start).count();
+  cerr << setw(28) << std::left << name << setw(10) << config
+       << std::right << std::fixed << std::setprecision(2) << setw(10) << ms << " ms" << endl;
+}
+
+void bench_device(BlockDevice::Type type) {
+  const uint num_blocks = DISKSIZE / BLOCKSIZE;
+  const uint ops = 200000;
+  auto dev = BlockDevice::create(type, IMAGE, num_blocks, BLOCKSIZE);
+  vector<char> buf(BLOCKSIZE, 'x');
+
+  srand(1);
+  timed("device random write", device_name(type), [&] {
+    for (uint i = 0; i < ops; i++) {
+      dev->write(static_cast<off_t>(rand() % num_blocks) * BLOCKSIZE, buf.data(), BLOCKSIZE);
+    }
+    dev->sync();
+  });
+  timed("device random read", device_name(type), [&] {
+    for (uint i = 0; i < ops; i++) {
+      dev->read(static_cast<off_t>(rand() % num_blocks) * BLOCKSIZE, buf.data(), BLOCKSIZE);
+    }
+  });
+  dev.reset();
+  remove(IMAGE.c_str());
+}
+
+void bench_fs(BlockDevice::Type type) {
+  const uint files = 64;
+  const uint writes_per_file = 64;
+  const string chunk(BLOCKSIZE, 'y');
+
+  remove(IMAGE.c_str());
+  FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, CACHEBLOCKS, type);
+  timed("fs sequential write", device_name(type), [&] {
+    for (uint f = 0; f < files; f++) {
+      fs.open({"open", "file" + to_string(f), "w"});
+      for (uint i = 0; i < writes_per_file; i++) {
+        fs.write({"write", to_string(f), chunk});
+      }
+      fs.close({"close", to_string(f)});
+    }
+  });
+  timed("fs sequential read", device_name(type), [&] {
+    for (uint f = 0; f < files; f++) {
+      fs.cat({"cat", "file" + to_string(f)});
+    }
+  });
+}
+
+void bench_engine(IoEngine::Type type, const string &config) {
+  const uint files = 16;
+  const uint rounds = 64;
+  const string chunk(8 * BLOCKSIZE, 'e');
+
+  remove(IMAGE.c_str());
+  FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, 1024, BlockDevice::posix_dev, type);
+  for (uint f = 0; f < files; f++) {
+    fs.open({"open", "file" + to_string(f), "w"});
+  }
+  timed("engine interleaved write", config, [&] {
+    for (uint r = 0; r < rounds; r++) {
+      for (uint f = 0; f < files; f++) {
+        fs.write({"write", to_string(f), chunk});
+      }
+    }
+    for (uint f = 0; f < files; f++) {
+      fs.close({"close", to_string(f)});
+    }
+  });
+  timed("engine scattered read", config, [&] {
+    for (uint f = 0; f < files; f++) {
+      fs.cat({"cat", "file" + to_string(f)});
+    }
+  });
+}
+
+void bench_mount() {
+  const uint dirs = 100;
+  const uint files_per_dir = 100;
+
+  remove(IMAGE.c_str());
+  {
+    FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, 4096, BlockDevice::posix_dev);
+    for (uint d = 0; d < dirs; d++) {
+      string dir = "/d" + to_string(d);
+      fs.mkdir({"mkdir", dir});
+      for (uint f = 0; f < files_per_dir; f++) {
+        fs.open({"open", dir + "/f" + to_string(f), "w"});
+        fs.close({"close", to_string(d * files_per_dir + f)});
+      }
+    }
+  }
+
+  timed("mount and stat", to_string(dirs * files_per_dir), [&] {
+    FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, 4096, BlockDevice::posix_dev);
+    fs.stat({"stat", "/d" + to_string(dirs - 1) + "/f" + to_string(files_per_dir - 1)});
+  });
+  remove(IMAGE.c_str());
+}
+
+//batch is how many operations a journal transaction may hold, 0 to run without the journal
+void bench_journal(const string &config, uint batch, uint threads) {
+  const uint dirs_per_thread = 1000;
+  const uint files_per_thread = 500;
+  const string chunk(BLOCKSIZE / 2, 'j');
+
+  Journal::Config journal;
+  journal.enabled = batch > 0;
+  journal.batch = max(batch, 1U);
+  remove(IMAGE.c_str());
+  FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, 4096, BlockDevice::posix_dev, IoEngine::auto_engine, journal);
+  for (uint t = 0; t < threads; t++) {
+    fs.open({"open", "/template" + to_string(t), "w"});
+    fs.write({"write", to_string(t), chunk});
+    fs.close({"close", to_string(t)});
+  }
+
+  auto run = [&](const string &name, double ops, function<void(uint)> worker) {
+    auto start = std::chrono::steady_clock::now();
+    vector<thread> pool;
+    for (uint t = 0; t < threads; t++) {
+      pool.emplace_back(worker, t);
+    }
+    for (auto &t : pool) {
+      t.join();
+    }
+    fs.sync({"sync"});
+    auto end = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(end - start).count();
+    cerr << setw(28) << std::left << name << setw(10) << config + " x" + to_string(threads)
+         << std::right << std::fixed << std::setprecision(0) << setw(10) << ops / secs << " ops/s" << endl;
+  };
+
+  run("journal mkdir", threads * dirs_per_thread, [&](uint id) {
+    string dir = "/m" + to_string(id);
+    fs.mkdir({"mkdir", dir});
+    for (uint d = 0; d < dirs_per_thread; d++) {
+      fs.mkdir({"mkdir", dir + "/d" + to_string(d)});
+    }
+  });
+  //a copy creates, writes and closes the new file
+  run("journal create", threads * files_per_thread, [&](uint id) {
+    string dir = "/c" + to_string(id);
+    fs.mkdir({"mkdir", dir});
+    for (uint f = 0; f < files_per_thread; f++) {
+      fs.copy({"cp", "/template" + to_string(id), dir + "/f" + to_string(f)});
+    }
+  });
+}
+
+//discards everything written to it and keeps no state, so threads can share it
+class NullBuf : public streambuf {
+ protected:
+  int overflow(int c) { return c; }
+  streamsize xsputn(const char *, streamsize n) { return n; }
+};
+
+void bench_threads(uint threads) {
+  const uint files_per_thread = 200;
+  const string chunk(4 * BLOCKSIZE, 't');
+
+  remove(IMAGE.c_str());
+  FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, 4096, BlockDevice::posix_dev);
+  //cp holds its source open, so every thread copies from a template of its own
+  for (uint t = 0; t < threads; t++) {
+    fs.open({"open", "/template" + to_string(t), "w"});
+    fs.write({"write", to_string(t), chunk});
+    fs.close({"close", to_string(t)});
+  }
+
+  auto worker = [&](uint id) {
+    string dir = "/t" + to_string(id);
+    fs.mkdir({"mkdir", dir});
+    for (uint f = 0; f < files_per_thread; f++) {
+      string name = dir + "/f" + to_string(f);
+      fs.copy({"cp", "/template" + to_string(id), name});
+      fs.cat({"cat", name});
+      fs.stat({"stat", name});
+      if (f % 2) fs.unlink({"unlink", name});
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  vector<thread> pool;
+  for (uint t = 0; t < threads; t++) {
+    pool.emplace_back(worker, t);
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  double secs = std::chrono::duration<double>(end - start).count();
+  double ops = 4.0 * threads * files_per_thread;
+  cerr << setw(28) << std::left << "threads cp/cat/stat/unlink" << setw(10) << threads
+       << std::right << std::fixed << std::setprecision(0) << setw(10) << ops / secs << " ops/s" << endl;
+}
+
+void bench_buffering(uint buffer, const string &config) {
+  const uint appends = 20000;
+  const string record(100, 'b');
+
+  remove(IMAGE.c_str());
+  FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, 1024, BlockDevice::posix_dev);
+  fs.set_write_buffer(buffer);
+  int a = fs.open("/a", FSImp::W);
+  int b = fs.open("/b", FSImp::W);
+  timed("buffered appends", config, [&] {
+    for (uint i = 0; i < appends; i++) {
+      fs.write(i % 2 ? b : a, record.data(), record.size());
+    }
+    fs.close(a);
+    fs.close(b);
+  });
+  FSImp::Stat st;
+  if (fs.stat("/a", st) == 0) {
+    cerr << setw(28) << std::left << "buffered extents" << setw(10) << config
+         << std::right << setw(10) << st.extents << endl;
+  }
+}
+
+void bench_readahead(uint window, const string &config) {
+  const uint file_size = 32 << 20;
+  const uint chunk = 4096;
+  vector<char> buf(1 << 20, 'r');
+
+  remove(IMAGE.c_str());
+  FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, 1024, BlockDevice::posix_dev);
+  fs.set_read_ahead(window);
+  int fd = fs.open("/stream", FSImp::W);
+  for (uint done = 0; done < file_size; done += buf.size()) {
+    fs.write(fd, buf.data(), buf.size());
+  }
+  fs.close(fd);
+  fs.fsync();
+
+  fd = fs.open("/stream", FSImp::R);
+  double mib = file_size / double(1 << 20);
+  auto start = std::chrono::steady_clock::now();
+  while (fs.read(fd, buf.data(), chunk) > 0) {
+  }
+  auto end = std::chrono::steady_clock::now();
+  fs.close(fd);
+
+  double secs = std::chrono::duration<double>(end - start).count();
+  cerr << setw(28) << std::left << "readahead stream" << setw(10) << config
+       << std::right << std::fixed << std::setprecision(0) << setw(10) << mib / secs << " MiB/s" << endl;
+  //the read-ahead counters, to see how much of what was fetched early got used
+  if (window > 0) {
+    auto old_buf = cout.rdbuf(cerr.rdbuf());
+    fs.prefetching({"readahead"});
+    cout.rdbuf(old_buf);
+  }
+}
+
+template <typename G>
+void bench_geometry(const G &geo, const string &config) {
+  const uint ops = 4000000;
+  const uint extents = 16384;
+  const uint file_size = extents * geo.size();
+  vector<uint> positions(ops);
+  srand(9);
+  for (auto &pos : positions) {
+    pos = rand() % file_size;
+  }
+
+  //a file whose blocks are every other block of the image, so each one is its own extent;
+  //no FSImp exists yet, so dropping the Inode touches no image
+  Inode inode(1, false);
+  for (uint b = 0; b < extents; b++) {
+    inode.append(100 + 2 * b, 1);
+  }
+  inode.size = file_size;
+
+  unsigned long sum = 0;
+  timed("geometry map offsets", config, [&] {
+    for (uint pos : positions) {
+      uint block = geo.block(pos);
+      sum += geo.image(block, pos) + geo.offset(pos) + geo.blocks(pos);
+    }
+  });
+  vector<std::pair<off_t, size_t> > ranges;
+  timed("geometry image ranges", config, [&] {
+    for (uint i = 0; i < ops / 16; i++) {
+      uint pos = positions[i];
+      inode.image_ranges(geo, pos, std::min(4 * geo.size(), file_size - pos), ranges);
+      sum += ranges.size();
+    }
+  });
+  if (sum == 0) cerr << "geometry: nothing mapped" << endl;
+}
+
+void bench_compound(bool compound) {
+  const uint files = 2000;
+  const uint files_per_compound = 8;
+  const uint writes_per_file = 16;
+  const string chunk(1000, 'c');
+  typedef FSImp::CompoundOp Op;
+
+  remove(IMAGE.c_str());
+  FSImp fs(IMAGE, DISKSIZE, BLOCKSIZE, 4096, BlockDevice::posix_dev);
+  timed("create and fill", compound ? "compound" : "calls", [&] {
+    vector<Op> ops;
+    vector<ssize_t> results;
+    for (uint f = 0; f < files; f += files_per_compound) {
+      ops.clear();
+      for (uint g = f; g < f + files_per_compound; g++) {
+        ops.push_back(Op::open("/f" + to_string(g), FSImp::W));
+        for (uint w = 0; w < writes_per_file; w++) {
+          ops.push_back(Op::write(chunk.data(), chunk.size()));
+        }
+        ops.push_back(Op::close());
+      }
+      if (compound) {
+        fs.compound(ops, results);
+        continue;
+      }
+      int fd = -1;
+      for (auto &op : ops) {
+        if (op.type == Op::open_op) {
+          fd = fs.open(op.path, op.mode);
+        } else if (op.type == Op::write_op) {
+          fs.write(fd, op.data, op.count);
+        } else {
+          fs.close(fd);
+        }
+      }
+    }
+  });
+}
+
+int main() {
+  //command output is not part of the measurement
+  std::ostringstream sink;
+  auto old_buf = cout.rdbuf(sink.rdbuf());
+
+  //the block size is read at run time so the compiler cannot fold the divisions away
+  volatile uint runtime_block_size = 4096;
+  bench_geometry(Geometry<4096>(4096), "compiled");
+  bench_geometry(RuntimeGeometry(runtime_block_size), "runtime");
+
+  for (auto type : DEVICES) {
+    bench_device(type);
+  }
+  for (auto type : DEVICES) {
+    bench_fs(type);
+    sink.str("");
+  }
+  bench_engine(IoEngine::uring_engine, "io_uring");
+  sink.str("");
+  bench_engine(IoEngine::pool_engine, "pool");
+  sink.str("");
+  bench_mount();
+  sink.str("");
+  bench_buffering(0, "off");
+  bench_buffering(64 * 1024, "64K");
+  bench_readahead(0, "off");
+  bench_readahead(32, "on");
+  bench_compound(false);
+  bench_compound(true);
+
+  NullBuf null_buf;
+  cout.rdbuf(&null_buf);
+  for (uint threads : {1U, 4U}) {
+    bench_journal("off", 0, threads);
+    bench_journal("batch 1", 1, threads);
+    bench_journal("group", Journal::Config().batch, threads);
+  }
+  for (uint threads = 1; threads <= 2 * std::max(1U, thread::hardware_concurrency()); threads *= 2) {
+    bench_threads(threads);
+  }
+
+  cout.rdbuf(old_buf);
+  remove(IMAGE.c_str());
+  return 0;
+}
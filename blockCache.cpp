@@ -0,0 +1,419 @@
+#include "blockCache.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iterator>
+
+using std::fill;
+using std::list;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::pair;
+using std::prev;
+using std::unique_lock;
+using std::vector;
+
+//a run must fit in the shard at once and in a single readv/writev
+BlockCache::Shard::Shard(BlockDevice &device, const uint block_size, const uint capacity, const uint max_run)
+    :device(device),
+     block_size(block_size),
+     capacity(capacity),
+     max_run(max_run){}
+
+//cached frame for block, moved to the front of the LRU, or lru.end() on a miss.
+//A busy frame is waited for, since a batch is filling it or writing it out.
+BlockCache::Shard::FrameIter BlockCache::Shard::lookup(uint block, unique_lock<mutex> &guard){
+    auto it = frames.find(block);
+    while(it != frames.end() && it->second->busy){
+        idle.wait(guard);
+        it = frames.find(block);
+    }
+    if(it == frames.end()) return lru.end();
+
+    stats.hits++;
+    if(it->second->ahead){
+        stats.ahead_hits++;
+        it->second->ahead = false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second;
+}
+
+//Frame for a block that is not cached yet, evicting the least recently used frame when full.
+//The frame contents are left for the caller to fill.
+BlockCache::Shard::FrameIter BlockCache::Shard::new_frame(uint block){
+    stats.misses++;
+    //reuse the least recently used frame that no batch holds
+    auto victim = lru.end();
+    if(lru.size() >= capacity){
+        for(auto it = lru.rbegin(); it != lru.rend(); ++it){
+            if(!it->busy){
+                victim = prev(it.base());
+                break;
+            }
+        }
+    }
+
+    //the shard only grows past capacity while every frame is busy
+    if(victim == lru.end()){
+        lru.push_front(Frame{block, false, false, false, vector<char>(block_size)});
+    } else{
+        if(victim->dirty) write_back(victim->block);
+        frames.erase(victim->block);
+        stats.evictions++;
+        victim->block = block;
+        victim->ahead = false;
+        lru.splice(lru.begin(), lru, victim);
+    }
+
+    frames[block] = lru.begin();
+    return lru.begin();
+}
+
+void BlockCache::Shard::forget(uint first, uint count, unique_lock<mutex> &guard){
+    for(uint block = first; block < first + count; block++){
+        auto it = frames.find(block);
+        //a batch writing the frame out must land before the hole is punched
+        while(it != frames.end() && it->second->busy){
+            idle.wait(guard);
+            it = frames.find(block);
+        }
+        if(it == frames.end()) continue;
+        dirty_blocks.erase(block);
+        lru.erase(it->second);
+        frames.erase(it);
+    }
+}
+
+//fill every frame in run, which holds consecutive blocks, with one device read
+void BlockCache::Shard::fetch_run(){
+    run_iov.clear();
+    for(auto frame : run){
+        run_iov.push_back(iovec{frame->data.data(), block_size});
+    }
+    device.readv(static_cast<off_t>(run.front()->block) * block_size, run_iov.data(), run_iov.size());
+    stats.device_ios++;
+    stats.device_blocks += run.size();
+}
+
+//write every frame in dirty_run, which holds consecutive dirty blocks, with one device write
+void BlockCache::Shard::write_back_run(){
+    run_iov.clear();
+    for(auto frame : dirty_run){
+        run_iov.push_back(iovec{frame->data.data(), block_size});
+        frame->dirty = false;
+        dirty_blocks.erase(frame->block);
+    }
+    device.writev(static_cast<off_t>(dirty_run.front()->block) * block_size, run_iov.data(), run_iov.size());
+    stats.writebacks += dirty_run.size();
+    stats.device_ios++;
+    stats.device_blocks += dirty_run.size();
+}
+
+//Write back a dirty block together with the dirty blocks directly around it.
+//Neighbours are usually evicted soon after anyway, so this turns many small writes into one.
+void BlockCache::Shard::write_back(uint block){
+    uint first = block;
+    while(first > 0 && block - first + 1 < max_run && dirty_blocks.count(first - 1) && !frames[first - 1]->busy) first--;
+
+    dirty_run.clear();
+    for(uint b = first; dirty_run.size() < max_run && dirty_blocks.count(b) && !frames[b]->busy; b++){
+        dirty_run.push_back(frames[b]);
+    }
+    write_back_run();
+}
+
+void BlockCache::Shard::mark_dirty(Frame &frame){
+    if(!frame.dirty){
+        frame.dirty = true;
+        dirty_blocks.insert(frame.block);
+    }
+}
+
+void BlockCache::Shard::read(off_t pos, char *dst, size_t len, unique_lock<mutex> &guard){
+    while(len > 0){
+        uint block = pos / block_size;
+        uint offset = pos % block_size;
+
+        auto frame = lookup(block, guard);
+        if(frame != lru.end()){
+            uint piece = min(len, static_cast<size_t>(block_size - offset));
+            memcpy(dst, frame->data.data() + offset, piece);
+            pos += piece;
+            dst += piece;
+            len -= piece;
+            continue;
+        }
+
+        //gather the run of uncached blocks starting here and fetch it in one go
+        run.clear();
+        size_t span = 0;
+        for(uint b = block; span < offset + len && run.size() < max_run && !frames.count(b); b++){
+            run.push_back(new_frame(b));
+            span += block_size;
+        }
+        fetch_run();
+
+        for(auto f : run){
+            uint piece = min(len, static_cast<size_t>(block_size - offset));
+            memcpy(dst, f->data.data() + offset, piece);
+            pos += piece;
+            dst += piece;
+            len -= piece;
+            offset = 0;
+        }
+    }
+}
+
+//Only partially written blocks that were in use before are fetched; whole blocks are simply overwritten.
+//Nothing reaches the device until the blocks are evicted or synced.
+void BlockCache::Shard::write(off_t pos, const char *src, size_t len, bool fresh, unique_lock<mutex> &guard){
+    while(len > 0){
+        uint block = pos / block_size;
+        uint offset = pos % block_size;
+        uint piece = min(len, static_cast<size_t>(block_size - offset));
+
+        auto frame = lookup(block, guard);
+        if(frame == lru.end()){
+            frame = new_frame(block);
+            if(piece != block_size && fresh){
+                fill(frame->data.begin(), frame->data.end(), 0);
+            } else if(piece != block_size){
+                run.assign(1, frame);
+                fetch_run();
+            }
+        }
+        memcpy(frame->data.data() + offset, src, piece);
+        mark_dirty(*frame);
+        pos += piece;
+        src += piece;
+        len -= piece;
+    }
+}
+
+//mark frame busy and append it to the last claim, or start a new one if it does not follow on
+void BlockCache::Shard::add_to_claim(FrameIter frame, vector<Claim> &claims){
+    frame->busy = true;
+    if(claims.empty() || claims.back().shard != this || claims.back().frames.size() >= max_run
+       || claims.back().frames.back()->block + 1 != frame->block){
+        claims.push_back(Claim{this, static_cast<off_t>(frame->block) * block_size, {}, {}});
+    }
+    claims.back().frames.push_back(frame);
+    claims.back().iov.push_back(iovec{frame->data.data(), block_size});
+}
+
+//frames for the uncached blocks of [first, first + count), to be filled by the batch
+void BlockCache::Shard::claim_missing(uint first, uint count, bool ahead, vector<Claim> &claims){
+    for(uint b = first; b < first + count; b++){
+        //cached already, or in flight for someone else
+        if(frames.count(b)) continue;
+        auto frame = new_frame(b);
+        frame->ahead = ahead;
+        add_to_claim(frame, claims);
+    }
+}
+
+//dirty frames of [first, first + count), marked clean now and written by the batch
+void BlockCache::Shard::claim_dirty(uint first, uint count, vector<Claim> &claims){
+    for(uint b = first; b < first + count; b++){
+        auto it = frames.find(b);
+        if(it == frames.end() || !it->second->dirty || it->second->busy) continue;
+        it->second->dirty = false;
+        dirty_blocks.erase(b);
+        add_to_claim(it->second, claims);
+    }
+}
+
+void BlockCache::Shard::claim_all_dirty(vector<Claim> &claims){
+    vector<uint> blocks(dirty_blocks.begin(), dirty_blocks.end());
+    for(uint b : blocks){
+        claim_dirty(b, 1, claims);
+    }
+}
+
+//Hand the frames of a finished claim back. A read that failed drops its frames;
+//a write that failed leaves them dirty so a later sync retries.
+void BlockCache::Shard::release(Claim &claim, bool write, bool done){
+    lock_guard<mutex> guard(lock);
+    for(auto frame : claim.frames){
+        frame->busy = false;
+        if(!done && write){
+            mark_dirty(*frame);
+        } else if(!done){
+            frames.erase(frame->block);
+            lru.erase(frame);
+        }
+    }
+    if(done){
+        stats.device_ios++;
+        stats.device_blocks += claim.frames.size();
+        if(write) stats.writebacks += claim.frames.size();
+        else if(claim.frames.front()->ahead) stats.ahead += claim.frames.size();
+    }
+    idle.notify_all();
+}
+
+const uint BlockCache::shard_span;
+
+BlockCache::BlockCache(BlockDevice &device, IoEngine &engine, const uint block_size, const uint capacity, const uint num_shards)
+    :device(device),
+     engine(engine),
+     block_size(block_size),
+     capacity(capacity){
+    uint count = max(num_shards, 1U);
+    uint shard_capacity = max(capacity / count, 2U);
+    uint max_run = min(min(shard_capacity - 1, shard_span), static_cast<uint>(IOV_MAX));
+    for(uint i = 0; i < count; i++){
+        shards.emplace_back(new Shard(device, block_size, shard_capacity, max_run));
+    }
+}
+
+BlockCache::~BlockCache(){
+    sync();
+}
+
+//split the request where it crosses into the next shard's span
+void BlockCache::read(off_t pos, char *dst, size_t len){
+    while(len > 0){
+        uint block = pos / block_size;
+        off_t span_end = static_cast<off_t>(block / shard_span + 1) * shard_span * block_size;
+        size_t piece = min(len, static_cast<size_t>(span_end - pos));
+
+        Shard &shard = shard_for(block);
+        {
+            unique_lock<mutex> guard(shard.lock);
+            shard.read(pos, dst, piece, guard);
+        }
+        pos += piece;
+        dst += piece;
+        len -= piece;
+    }
+}
+
+void BlockCache::write(off_t pos, const char *src, size_t len, bool fresh){
+    while(len > 0){
+        uint block = pos / block_size;
+        off_t span_end = static_cast<off_t>(block / shard_span + 1) * shard_span * block_size;
+        size_t piece = min(len, static_cast<size_t>(span_end - pos));
+
+        Shard &shard = shard_for(block);
+        {
+            unique_lock<mutex> guard(shard.lock);
+            shard.write(pos, src, piece, fresh, guard);
+        }
+        pos += piece;
+        src += piece;
+        len -= piece;
+    }
+}
+
+//claim the blocks of every range, a shard at a time, split where a range crosses into the next shard's span
+void BlockCache::claim(const vector<pair<off_t, size_t> > &ranges, bool dirty, bool ahead, vector<Shard::Claim> &claims){
+    for(auto &range : ranges){
+        if(range.second == 0) continue;
+        uint block = range.first / block_size;
+        uint last = (range.first + range.second - 1) / block_size;
+        while(block <= last){
+            uint count = min(last + 1, (block / shard_span + 1) * shard_span) - block;
+            Shard &shard = shard_for(block);
+            lock_guard<mutex> guard(shard.lock);
+            if(dirty) shard.claim_dirty(block, count, claims);
+            else shard.claim_missing(block, count, ahead, claims);
+            block += count;
+        }
+    }
+}
+
+//run every claim as one engine batch with no shard lock held, then release the frames
+void BlockCache::submit(vector<Shard::Claim> &claims, bool write){
+    if(claims.empty()) return;
+
+    vector<IoEngine::Request> batch;
+    batch.reserve(claims.size());
+    for(auto &c : claims){
+        batch.push_back(IoEngine::Request{write, c.pos, c.iov.data(), static_cast<int>(c.iov.size())});
+    }
+    try{
+        engine.run(batch);
+    } catch(...){
+        for(auto &c : claims) c.shard->release(c, write, false);
+        throw;
+    }
+    for(auto &c : claims) c.shard->release(c, write, true);
+}
+
+void BlockCache::prefetch(const vector<pair<off_t, size_t> > &ranges, bool ahead){
+    vector<Shard::Claim> claims;
+    claim(ranges, false, ahead, claims);
+    submit(claims, false);
+}
+
+void BlockCache::write_behind(const vector<pair<off_t, size_t> > &ranges){
+    vector<Shard::Claim> claims;
+    claim(ranges, true, false, claims);
+    submit(claims, true);
+}
+
+//write back every shard in one batch and sync the device once if anything was dirty
+void BlockCache::sync(){
+    vector<Shard::Claim> claims;
+    for(auto &shard : shards){
+        lock_guard<mutex> guard(shard->lock);
+        shard->claim_all_dirty(claims);
+    }
+    if(claims.empty()) return;
+
+    submit(claims, true);
+    device.sync();
+}
+
+bool BlockCache::discard(uint first, uint count){
+    uint block = first;
+    while(block < first + count){
+        uint piece = min(first + count, (block / shard_span + 1) * shard_span) - block;
+        Shard &shard = shard_for(block);
+        {
+            unique_lock<mutex> guard(shard.lock);
+            shard.forget(block, piece, guard);
+        }
+        block += piece;
+    }
+    return device.discard(static_cast<off_t>(first) * block_size, static_cast<size_t>(count) * block_size);
+}
+
+BlockCache::Stats BlockCache::stats(){
+    Stats total;
+    for(auto &shard : shards){
+        lock_guard<mutex> guard(shard->lock);
+        total.hits += shard->stats.hits;
+        total.misses += shard->stats.misses;
+        total.evictions += shard->stats.evictions;
+        total.writebacks += shard->stats.writebacks;
+        total.device_ios += shard->stats.device_ios;
+        total.device_blocks += shard->stats.device_blocks;
+        total.ahead += shard->stats.ahead;
+        total.ahead_hits += shard->stats.ahead_hits;
+    }
+    return total;
+}
+
+uint BlockCache::size(){
+    uint total = 0;
+    for(auto &shard : shards){
+        lock_guard<mutex> guard(shard->lock);
+        total += shard->size();
+    }
+    return total;
+}
+
+uint BlockCache::dirty(){
+    uint total = 0;
+    for(auto &shard : shards){
+        lock_guard<mutex> guard(shard->lock);
+        total += shard->dirty();
+    }
+    return total;
+}
@@ -0,0 +1,148 @@
+/*
+The BlockCache sits between FSImp and the BlockDevice holding the disk image and contains
+1. a fixed number of block sized frames (the capacity)
+2. an LRU list of the cached frames, most recently used at the front
+3. a map from block number to its frame in the LRU list
+4. a dirty flag per frame; dirty frames are written back on eviction or sync
+5. hit/miss/eviction/writeback counters so the cache can be sized
+6. I/O coalescing: a run of missing blocks is fetched with one device readv and
+   a run of dirty blocks is written back with one device writev
+7. shards, each an independent LRU with its own lock; the image is dealt out to
+   the shards in spans of shard_span consecutive blocks, so a coalesced run
+   never needs more than one shard
+8. batched I/O through an IoEngine: prefetch, write behind and sync claim their
+   frames (marking them busy) under the shard locks, drop the locks, and submit
+   every run as one batch; lookups of a busy frame wait for it and eviction skips it
+9. discard: freed blocks leave the cache without being written back and are
+   punched out of the image
+10. read-ahead accounting: frames a read-ahead loaded are flagged until first used,
+   so it shows how many of the blocks fetched early were wanted before eviction
+*/
+
+#ifndef _BLOCKCACHE_H_
+#define _BLOCKCACHE_H_
+
+#include "blockDevice.hpp"
+#include "ioEngine.hpp"
+
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+class BlockCache{
+    public:
+        struct Stats{
+            unsigned long hits = 0;
+            unsigned long misses = 0;
+            unsigned long evictions = 0;
+            unsigned long writebacks = 0;
+            unsigned long device_ios = 0;       //readv/writev calls issued to the device
+            unsigned long device_blocks = 0;    //blocks moved by those calls
+            unsigned long ahead = 0;            //blocks loaded by read-ahead
+            unsigned long ahead_hits = 0;       //of those, blocks read before they were evicted
+        };
+
+    private:
+        class Shard{
+            public:
+                struct Frame{
+                    uint block;
+                    bool dirty;
+                    bool busy;      //claimed for a batch in flight
+                    bool ahead;     //loaded by read-ahead and not used since
+                    std::vector<char> data;
+                };
+                typedef std::list<Frame>::iterator FrameIter;
+
+                //consecutive frames handed to the IoEngine as one request
+                struct Claim{
+                    Shard *shard;
+                    off_t pos;
+                    std::vector<FrameIter> frames;
+                    std::vector<struct iovec> iov;
+                };
+
+            private:
+                BlockDevice &device;
+                const uint block_size;
+                const uint capacity;
+                const uint max_run;
+                std::list<Frame> lru;
+                std::unordered_map<uint, FrameIter> frames;
+                std::set<uint> dirty_blocks;
+                std::vector<FrameIter> run;             //scratch for building coalesced reads
+                std::vector<FrameIter> dirty_run;       //scratch for building coalesced write backs
+                std::vector<struct iovec> run_iov;
+
+                FrameIter lookup(uint block, std::unique_lock<std::mutex> &guard);
+                FrameIter new_frame(uint block);
+                void add_to_claim(FrameIter frame, std::vector<Claim> &claims);
+                void fetch_run();
+                void write_back_run();
+                void write_back(uint block);
+                void mark_dirty(Frame &frame);
+
+            public:
+                std::mutex lock;
+                std::condition_variable idle;       //signalled when busy frames are released
+                Stats stats;
+
+                Shard(BlockDevice &device, const uint block_size, const uint capacity, const uint max_run);
+                void read(off_t pos, char *dst, size_t len, std::unique_lock<std::mutex> &guard);
+                void write(off_t pos, const char *src, size_t len, bool fresh, std::unique_lock<std::mutex> &guard);
+                //drop the frames of [first, first + count), dirty or not
+                void forget(uint first, uint count, std::unique_lock<std::mutex> &guard);
+
+                //the claim_* calls need the lock held; release takes it itself
+                void claim_missing(uint first, uint count, bool ahead, std::vector<Claim> &claims);
+                void claim_dirty(uint first, uint count, std::vector<Claim> &claims);
+                void claim_all_dirty(std::vector<Claim> &claims);
+                void release(Claim &claim, bool write, bool done);
+
+                uint size() const { return lru.size(); }
+                uint dirty() const { return dirty_blocks.size(); }
+        };
+
+        static const uint shard_span = 1024;
+        BlockDevice &device;
+        IoEngine &engine;
+        const uint block_size;
+        const uint capacity;
+        std::vector<std::unique_ptr<Shard> > shards;
+
+        Shard &shard_for(uint block) { return *shards[block / shard_span % shards.size()]; }
+        void claim(const std::vector<std::pair<off_t, size_t> > &ranges, bool dirty, bool ahead, std::vector<Shard::Claim> &claims);
+        void submit(std::vector<Shard::Claim> &claims, bool write);
+
+    public:
+        BlockCache(BlockDevice &device, IoEngine &engine, const uint block_size, const uint capacity, const uint num_shards);
+        ~BlockCache();
+
+        //pos is a byte address on the image; [pos, pos + len) may span
+        //several blocks that are physically contiguous on the image
+        void read(off_t pos, char *dst, size_t len);
+        //fresh: the blocks were just allocated, so a partial write starts from zeroes instead of a fetch
+        void write(off_t pos, const char *src, size_t len, bool fresh = false);
+        //ranges are (byte position, length) pairs on the image, handled as one engine batch:
+        //prefetch loads the blocks that are not cached, write_behind writes back the dirty ones;
+        //ahead marks a speculative prefetch, counted in the read-ahead statistics
+        void prefetch(const std::vector<std::pair<off_t, size_t> > &ranges, bool ahead = false);
+        void write_behind(const std::vector<std::pair<off_t, size_t> > &ranges);
+        void sync();
+        //blocks [first, first + count) were freed: their contents no longer matter and the
+        //device may give their space back; false if the device keeps them
+        bool discard(uint first, uint count);
+
+        Stats stats();
+        uint size();
+        uint dirty();
+        uint max_size() const { return capacity; }
+};
+
+#endif
@@ -0,0 +1,235 @@
+#include "blockDevice.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::fstream;
+using std::lock_guard;
+using std::mutex;
+using std::runtime_error;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+unique_ptr<BlockDevice> BlockDevice::create(Type type,
+                                            const string &filename,
+                                            const uint num_blocks,
+                                            const uint block_size){
+    if(type == mmap_dev)
+        return unique_ptr<BlockDevice>(new MmapDevice(filename, num_blocks, block_size));
+    if(type == fstream_dev)
+        return unique_ptr<BlockDevice>(new FileDevice(filename, num_blocks, block_size));
+    return unique_ptr<BlockDevice>(new PosixDevice(filename, num_blocks, block_size));
+}
+
+//backends without a native vectored call do one read/write per buffer
+void BlockDevice::readv(off_t pos, const struct iovec *iov, int iovcnt){
+    for(int i = 0; i < iovcnt; i++){
+        read(pos, static_cast<char *>(iov[i].iov_base), iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+}
+
+void BlockDevice::writev(off_t pos, const struct iovec *iov, int iovcnt){
+    for(int i = 0; i < iovcnt; i++){
+        write(pos, static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+}
+
+//Grow the image to size with ftruncate, which leaves a hole instead of writing zeroes,
+//so even a large image is created at once; an existing image keeps its contents.
+static bool size_image(int fd, off_t size){
+    struct stat st;
+    if(fstat(fd, &st) < 0) return false;
+    return st.st_size >= size || ftruncate(fd, size) == 0;
+}
+
+//host blocks backing the image, which stat counts in 512 byte units
+static off_t host_bytes(const struct stat &st){
+    return static_cast<off_t>(st.st_blocks) * 512;
+}
+
+//Deallocate [pos, pos + len) of the image; the file keeps its size and the range reads
+//as zeroes. File systems without hole punching report EOPNOTSUPP and keep the data.
+static bool punch_hole(int fd, off_t pos, size_t len){
+    int rc;
+    do{
+        rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len);
+    } while(rc < 0 && errno == EINTR);
+    return rc == 0;
+}
+
+//size the image with ftruncate, which leaves new space a zero filled hole
+PosixDevice::PosixDevice(const string &filename, const uint num_blocks, const uint block_size){
+    image_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if(image_fd < 0)
+        throw runtime_error("cannot open disk image " + filename);
+
+    if(!size_image(image_fd, static_cast<off_t>(num_blocks) * block_size)){
+        ::close(image_fd);
+        throw runtime_error("cannot size disk image " + filename);
+    }
+}
+
+PosixDevice::~PosixDevice(){
+    ::close(image_fd);
+}
+
+void PosixDevice::read(off_t pos, char *dst, size_t len){
+    struct iovec iov = {dst, len};
+    readv(pos, &iov, 1);
+}
+
+void PosixDevice::write(off_t pos, const char *src, size_t len){
+    struct iovec iov = {const_cast<char *>(src), len};
+    writev(pos, &iov, 1);
+}
+
+//step past n bytes that preadv/pwritev already transferred
+static void advance(struct iovec *&cur, int &iovcnt, size_t n){
+    while(iovcnt > 0 && n >= cur->iov_len){
+        n -= cur->iov_len;
+        cur++;
+        iovcnt--;
+    }
+    if(iovcnt > 0){
+        cur->iov_base = static_cast<char *>(cur->iov_base) + n;
+        cur->iov_len -= n;
+    }
+}
+
+//preadv/pwritev may transfer less than asked for, so keep going from where they stopped
+void PosixDevice::readv(off_t pos, const struct iovec *iov, int iovcnt){
+    vector<struct iovec> left(iov, iov + iovcnt);
+    struct iovec *cur = left.data();
+    while(iovcnt > 0){
+        ssize_t n = ::preadv(image_fd, cur, iovcnt, pos);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) throw runtime_error("read from disk image failed");
+        pos += n;
+        advance(cur, iovcnt, n);
+    }
+}
+
+void PosixDevice::writev(off_t pos, const struct iovec *iov, int iovcnt){
+    vector<struct iovec> left(iov, iov + iovcnt);
+    struct iovec *cur = left.data();
+    while(iovcnt > 0){
+        ssize_t n = ::pwritev(image_fd, cur, iovcnt, pos);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) throw runtime_error("write to disk image failed");
+        pos += n;
+        advance(cur, iovcnt, n);
+    }
+}
+
+void PosixDevice::sync(){
+    fdatasync(image_fd);
+}
+
+bool PosixDevice::discard(off_t pos, size_t len){
+    return punch_hole(image_fd, pos, len);
+}
+
+off_t PosixDevice::allocated() const{
+    struct stat st;
+    return fstat(image_fd, &st) < 0 ? 0 : host_bytes(st);
+}
+
+//create the image, extending it as a sparse file to its full size
+FileDevice::FileDevice(const string &filename, const uint num_blocks, const uint block_size)
+    :filename(filename){
+    disk_file.open(filename, fstream::in | fstream::out | fstream::binary);
+    if(!disk_file.is_open())
+        disk_file.open(filename, fstream::in | fstream::out | fstream::binary | fstream::trunc);
+    if(!disk_file.is_open())
+        throw runtime_error("cannot open disk image " + filename);
+
+    //the stream cannot leave a hole, so the file is extended by name before the first access
+    struct stat st;
+    off_t end = static_cast<off_t>(num_blocks) * block_size;
+    if(::stat(filename.c_str(), &st) < 0 || (st.st_size < end && ::truncate(filename.c_str(), end) < 0))
+        throw runtime_error("cannot size disk image " + filename);
+}
+
+FileDevice::~FileDevice(){
+    disk_file.close();
+}
+
+void FileDevice::read(off_t pos, char *dst, size_t len){
+    lock_guard<mutex> guard(lock);
+    disk_file.seekg(pos);
+    disk_file.read(dst, len);
+}
+
+void FileDevice::write(off_t pos, const char *src, size_t len){
+    lock_guard<mutex> guard(lock);
+    disk_file.seekp(pos);
+    disk_file.write(src, len);
+}
+
+void FileDevice::sync(){
+    lock_guard<mutex> guard(lock);
+    disk_file.flush();
+}
+
+off_t FileDevice::allocated() const{
+    struct stat st;
+    return ::stat(filename.c_str(), &st) < 0 ? 0 : host_bytes(st);
+}
+
+//size the image with ftruncate (which leaves a zero filled hole) and map all of it
+MmapDevice::MmapDevice(const string &filename, const uint num_blocks, const uint block_size)
+    :map_size(static_cast<size_t>(num_blocks) * block_size){
+    image_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if(image_fd < 0)
+        throw runtime_error("cannot open disk image " + filename);
+
+    if(!size_image(image_fd, map_size)){
+        ::close(image_fd);
+        throw runtime_error("cannot size disk image " + filename);
+    }
+
+    void *addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+    if(addr == MAP_FAILED){
+        ::close(image_fd);
+        throw runtime_error("cannot map disk image " + filename);
+    }
+    map = static_cast<char *>(addr);
+}
+
+MmapDevice::~MmapDevice(){
+    msync(map, map_size, MS_SYNC);
+    munmap(map, map_size);
+    ::close(image_fd);
+}
+
+void MmapDevice::read(off_t pos, char *dst, size_t len){
+    memcpy(dst, map + pos, len);
+}
+
+void MmapDevice::write(off_t pos, const char *src, size_t len){
+    memcpy(map + pos, src, len);
+}
+
+void MmapDevice::sync(){
+    msync(map, map_size, MS_SYNC);
+}
+
+//the mapping is shared, so a hole punched in the file shows up in it as zeroes
+bool MmapDevice::discard(off_t pos, size_t len){
+    return punch_hole(image_fd, pos, len);
+}
+
+off_t MmapDevice::allocated() const{
+    struct stat st;
+    return fstat(image_fd, &st) < 0 ? 0 : host_bytes(st);
+}
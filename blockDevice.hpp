@@ -0,0 +1,95 @@
+/*
+A BlockDevice is the only thing that touches the disk image. It contains
+1. byte addressed read/write of the image
+2. vectored readv/writev that move one contiguous range of the image into or
+   out of several buffers in a single I/O
+3. a sync that makes earlier writes durable
+4. an existing image is opened as it is; a new or short one is extended as a sparse
+   file, so the host only spends space on blocks that have been written
+5. discard, which punches freed blocks out of the image and gives their space back
+   to the host; they read as zeroes afterwards
+6. three backends:
+	- PosixDevice: positional pread/pwrite (preadv/pwritev) on a file descriptor,
+	  independent of any shared seek pointer
+	- FileDevice: the image is accessed through an std::fstream, one access at a time;
+	  a stream cannot punch holes, so it does not discard
+	- MmapDevice: the whole image (num_blocks * block_size) is mapped and
+	  reads/writes become memcpy into or out of the mapping
+*/
+
+#ifndef _BLOCKDEVICE_H_
+#define _BLOCKDEVICE_H_
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+class BlockDevice{
+    public:
+        enum Type {posix_dev, fstream_dev, mmap_dev};
+
+        static std::unique_ptr<BlockDevice> create(Type type,
+                                                   const std::string &filename,
+                                                   const uint num_blocks,
+                                                   const uint block_size);
+        virtual ~BlockDevice() {}
+
+        virtual void read(off_t pos, char *dst, size_t len) = 0;
+        virtual void write(off_t pos, const char *src, size_t len) = 0;
+        virtual void readv(off_t pos, const struct iovec *iov, int iovcnt);
+        virtual void writev(off_t pos, const struct iovec *iov, int iovcnt);
+        virtual void sync() = 0;
+        //punch [pos, pos + len) out of the image; false if the blocks keep their contents
+        virtual bool discard(off_t, size_t) { return false; }
+        //bytes of host storage the image occupies
+        virtual off_t allocated() const = 0;
+        //descriptor of the image for engines that issue their own I/O, -1 if there is none
+        virtual int fd() const { return -1; }
+};
+
+class PosixDevice : public BlockDevice{
+        int image_fd;
+    public:
+        PosixDevice(const std::string &filename, const uint num_blocks, const uint block_size);
+        ~PosixDevice();
+        void read(off_t pos, char *dst, size_t len);
+        void write(off_t pos, const char *src, size_t len);
+        void readv(off_t pos, const struct iovec *iov, int iovcnt);
+        void writev(off_t pos, const struct iovec *iov, int iovcnt);
+        void sync();
+        bool discard(off_t pos, size_t len);
+        off_t allocated() const;
+        int fd() const { return image_fd; }
+};
+
+class FileDevice : public BlockDevice{
+        const std::string filename;
+        std::fstream disk_file;
+        std::mutex lock;        //the stream has one shared seek pointer
+    public:
+        FileDevice(const std::string &filename, const uint num_blocks, const uint block_size);
+        ~FileDevice();
+        void read(off_t pos, char *dst, size_t len);
+        void write(off_t pos, const char *src, size_t len);
+        void sync();
+        off_t allocated() const;
+};
+
+class MmapDevice : public BlockDevice{
+        int image_fd;
+        char *map;
+        size_t map_size;
+    public:
+        MmapDevice(const std::string &filename, const uint num_blocks, const uint block_size);
+        ~MmapDevice();
+        void read(off_t pos, char *dst, size_t len);
+        void write(off_t pos, const char *src, size_t len);
+        void sync();
+        bool discard(off_t pos, size_t len);
+        off_t allocated() const;
+};
+
+#endif
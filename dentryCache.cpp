@@ -0,0 +1,75 @@
+#include "dentryCache.hpp"
+
+#include <iterator>
+
+using std::lock_guard;
+using std::mutex;
+using std::prev;
+using std::string;
+
+DentryCache::DentryCache(const uint capacity)
+    :capacity(capacity), hits(0), misses(0){}
+
+void DentryCache::name_created(){
+    lock_guard<mutex> guard(lock);
+    create_generation++;
+}
+
+void DentryCache::name_removed(){
+    lock_guard<mutex> guard(lock);
+    generation++;
+}
+
+uint DentryCache::size(){
+    lock_guard<mutex> guard(lock);
+    return lru.size();
+}
+
+void DentryCache::erase(std::list<Entry>::iterator it){
+    entries.erase(Key{it->start, &it->path});
+    lru.erase(it);
+}
+
+bool DentryCache::lookup(const DirEntry *start, const string &path, Resolution &res, Stamp &stamp){
+    lock_guard<mutex> guard(lock);
+    stamp = Stamp{generation, create_generation};
+    auto kv = entries.find(Key{start, &path});
+    if(kv == entries.end()){
+        misses++;
+        return false;
+    }
+
+    //stale if a name was removed since, or if it is negative and a name was created since
+    auto it = kv->second;
+    bool stale = it->generation != generation ||
+                 (it->negative && it->create_generation != create_generation);
+    res.parent_node = it->parent_node.lock();
+    res.final_node = it->final_node.lock();
+    if(stale || res.parent_node == nullptr ||
+       (!it->negative && res.final_node == nullptr)){
+        erase(it);
+        misses++;
+        return false;
+    }
+
+    hits++;
+    res.invalid_path = it->invalid_path;
+    res.final_name = it->final_name;
+    lru.splice(lru.begin(), lru, it);
+    return true;
+}
+
+void DentryCache::insert(const DirEntry *start, const string &path, const Resolution &res, const Stamp &stamp){
+    if(capacity == 0) return;
+    lock_guard<mutex> guard(lock);
+
+    auto kv = entries.find(Key{start, &path});
+    if(kv != entries.end()) erase(kv->second);
+    if(lru.size() >= capacity) erase(prev(lru.end()));
+
+    bool negative = res.final_node == nullptr;
+    lru.push_front(Entry{start, path, res.invalid_path, res.final_name,
+                         res.parent_node, res.final_node, negative,
+                         stamp.generation, stamp.create_generation});
+    entries[Key{start, &lru.front().path}] = lru.begin();
+}
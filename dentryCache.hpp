@@ -0,0 +1,92 @@
+/*
+The DentryCache remembers the result of resolving a path from a starting
+directory so repeated opens/stats of the same path skip the walk. It contains
+1. a bounded LRU list of resolutions keyed by (starting directory, path)
+2. negative entries for names that did not exist when they were resolved
+3. two generation counters used for invalidation:
+	- removing a name (rmdir, unlink) makes every cached resolution stale
+	- creating a name (open, mkdir, link) makes only the negative ones stale
+Entries hold weak pointers, so the cache never keeps a removed DirEntry alive.
+All methods take the cache's lock. A resolution is inserted with the generations
+taken before the walk started, so one racing with a removal is born stale.
+*/
+
+#ifndef _DENTRYCACHE_H_
+#define _DENTRYCACHE_H_
+
+#include "dirEntry.hpp"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+
+class DentryCache{
+    public:
+        struct Resolution{
+            bool invalid_path = false;
+            std::string final_name;
+            std::shared_ptr<DirEntry> parent_node;
+            std::shared_ptr<DirEntry> final_node;
+        };
+
+    private:
+        struct Entry{
+            const DirEntry *start;
+            std::string path;
+            bool invalid_path;
+            std::string final_name;
+            std::weak_ptr<DirEntry> parent_node;
+            std::weak_ptr<DirEntry> final_node;
+            bool negative;
+            unsigned long generation;
+            unsigned long create_generation;
+        };
+
+        //points at the path owned by an Entry, or at the caller's path during lookup
+        struct Key{
+            const DirEntry *start;
+            const std::string *path;
+            bool operator==(const Key &other) const{
+                return start == other.start && *path == *other.path;
+            }
+        };
+        struct KeyHash{
+            size_t operator()(const Key &key) const{
+                return std::hash<std::string>()(*key.path) ^ std::hash<const DirEntry *>()(key.start);
+            }
+        };
+
+        const uint capacity;
+        std::mutex lock;
+        std::list<Entry> lru;
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> entries;
+        unsigned long generation = 0;
+        unsigned long create_generation = 0;
+
+        void erase(std::list<Entry>::iterator it);
+
+    public:
+        struct Stamp{
+            unsigned long generation;
+            unsigned long create_generation;
+        };
+
+        std::atomic<unsigned long> hits;
+        std::atomic<unsigned long> misses;
+
+        DentryCache(const uint capacity);
+
+        //on a miss, stamp is set to the generations to insert the walked resolution with
+        bool lookup(const DirEntry *start, const std::string &path, Resolution &res, Stamp &stamp);
+        void insert(const DirEntry *start, const std::string &path, const Resolution &res, const Stamp &stamp);
+        void name_created();
+        void name_removed();
+
+        uint size();
+};
+
+#endif
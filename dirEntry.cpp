@@ -1,79 +1,240 @@
 #include "dirEntry.hpp"
 
 #include <algorithm>
+#include <iterator>
 #include <sstream>
 #include <vector>
 
 using std::find_if; //returns the first element that satisfies the unary function. Returns the last element if otherwise
 using std::istringstream; //used to convert int->string or string->int
-using std::make_shared;
+using std::allocate_shared;
+using std::const_pointer_cast;
+using std::list;
+using std::lock_guard;
+using std::mutex;
+using std::prev;
 using std::shared_ptr;
 using std::string;
 using std::vector;
-using std::weak_ptr;
 
-DirEntry::DirEntry(){
+SuperBlock *DirEntry::store = nullptr;
+Slab DirEntry::entry_slab;
+Slab DirEntry::link_slab;
+Slab DirEntry::dir_slab(128);
+
+DirEntry::Directory::Directory(bool loaded)
+    :contents(SlabAllocator<shared_ptr<DirEntry> >(link_slab)),
+     removed(false),
+     loaded(loaded),
+     dead_bytes(0){}
+
+DirEntry::DirEntry(Token){
     is_locked = false;
+    slot = 0;
 }
 
-shared_ptr<DirEntry> DirEntry::make_dir(const string name, 
-                                        const shared_ptr<DirEntry> parent){
-    
-    auto sp = make_shared<DirEntry>(DirEntry());
+//the entry and its reference counts share one slot of entry_slab
+shared_ptr<DirEntry> DirEntry::make(EntryType type, const string &name,
+                                    const shared_ptr<DirEntry> &parent,
+                                    const shared_ptr<Inode> &inode){
+    auto sp = allocate_shared<DirEntry>(SlabAllocator<DirEntry>(entry_slab), Token());
     if(parent == nullptr){
         sp->parent = sp;
     } else {
         sp->parent = parent;
     }
 
-    sp->type = dir;
-    sp->self = sp;
+    sp->type = type;
     sp->name = name;
-    sp->inode = nullptr;
+    sp->inode = inode;
+    return sp;
+}
+
+//a directory with records on the image is loaded when first used
+shared_ptr<DirEntry> DirEntry::make_dir(const string name, 
+                                        const shared_ptr<DirEntry> parent,
+                                        const shared_ptr<Inode> &inode){
+    auto sp = make(dir, name, parent, inode);
+    sp->directory.reset(new Directory(inode->size == 0));
     return sp;
 }
 
 shared_ptr<DirEntry> DirEntry::make_file(const string name, 
                                          const shared_ptr<DirEntry> parent, 
                                          const shared_ptr<Inode> &inode){
-    
-    auto sp = make_shared<DirEntry>(DirEntry());
-    if(parent == nullptr){
-        sp->parent = sp;
-    } else {
-        sp->parent = parent;
+    return make(file, name, parent, inode);
+}
+
+//read the directory's records and the inodes they name; the directory's lock must be held
+void DirEntry::load() const{
+    Directory &d = *directory;
+    if(d.loaded) return;
+    d.loaded = true;
+
+    vector<SuperBlock::DirRecord> records;
+    store->read_dir(*inode, records);
+    auto me = const_pointer_cast<DirEntry>(shared_from_this());
+    for(auto &rec : records){
+        auto child_inode = store->get_inode(rec.ino);
+        auto child = rec.is_dir ? make_dir(rec.name, me, child_inode)
+                                : make_file(rec.name, me, child_inode);
+        child->slot = rec.offset;
+        d.contents.push_back(child);
+        index_entry(prev(d.contents.end()));
     }
+    d.dead_bytes = inode->size;
+    for(auto &rec : records) d.dead_bytes -= SuperBlock::record_size(rec.name);
+}
 
-    sp->type = file;
-    sp->self = sp;
-    sp->name = name;
-    sp->inode = nullptr;
-    return sp;
+//keep the index up to date with the entry just added at it
+void DirEntry::index_entry(ContentsIter it) const{
+    Directory &d = *directory;
+    if(!d.index.empty()){
+        d.index[(*it)->name] = it;
+    } else if(d.contents.size() > index_threshold){
+        //directory got big enough to be worth hashing
+        d.index.reserve(d.contents.size() * 2);
+        for(auto i = d.contents.begin(); i != d.contents.end(); ++i){
+            d.index[(*i)->name] = i;
+        }
+    }
+}
+
+//position of name in contents, or contents.end(); small directories are scanned
+DirEntry::ContentsConstIter DirEntry::find_iter(const string &name) const{
+    const Directory &d = *directory;
+    if(!d.index.empty()){
+        auto it = d.index.find(name);
+        return it == d.index.end() ? d.contents.end() : it->second;
+    }
+
+    auto named = [&] (const shared_ptr<DirEntry> &de) {return de->name == name;};
+    return find_if(d.contents.begin(), d.contents.end(), named);
 }
 
-shared_ptr<DirEntry> DirEntry::find_child(const string name) const {
+shared_ptr<DirEntry> DirEntry::find_child(const string &name) const {
     //handle current and parent directories
     if(name == "..") return parent.lock();
-    else if(name == ".") return self.lock();
+    else if(name == ".") return const_pointer_cast<DirEntry>(shared_from_this());
+    if(!directory) return nullptr;
 
-    //search through contents and return pointer if found, else return nullptr;
-    auto named = [&] (const shared_ptr<DirEntry> de) {return de->name == name;};
-    auto it = find_if(contents.begin(), contents.end(), named);
+    //hashed lookup once indexed, else search through contents; nullptr if not found
+    lock_guard<mutex> guard(directory->lock);
+    load();
+    auto it = find_iter(name);
     
-    if(it == contents.end()) return nullptr;
+    if(it == directory->contents.end()) return nullptr;
 
     return *it;
 
 }
 
+//add entry unless its name is taken, recording it in the directory blocks and
+//counting the link on its inode; the directory's lock must be held
+bool DirEntry::insert(const shared_ptr<DirEntry> &entry){
+    Directory &d = *directory;
+    load();
+    if(d.removed || find_iter(entry->name) != d.contents.end()) return false;
+    if(!store->add_record(*inode, entry->inode->ino, entry->type == dir, entry->name, entry->slot)) return false;
+
+    {
+        WriteGuard inode_guard(entry->inode->lock);
+        entry->inode->links++;
+        store->write_inode(*entry->inode);
+    }
+
+    d.contents.push_back(entry);
+    index_entry(prev(d.contents.end()));
+    return true;
+}
+
+//rewrite the directory blocks without the records of removed names; the directory's lock must be held
+void DirEntry::compact(){
+    Directory &d = *directory;
+    vector<SuperBlock::DirRecord> records;
+    records.reserve(d.contents.size());
+    for(auto &de : d.contents){
+        records.push_back(SuperBlock::DirRecord{de->inode->ino, de->type == dir, de->name, 0});
+    }
+    if(!store->rewrite_dir(*inode, records)) return;
+
+    auto rec = records.begin();
+    for(auto &de : d.contents){
+        de->slot = (rec++)->offset;
+    }
+    d.dead_bytes = 0;
+}
+
+bool DirEntry::add_entry(const shared_ptr<DirEntry> &entry){
+    if(!directory) return false;
+    lock_guard<mutex> guard(directory->lock);
+    return insert(entry);
+}
+
+//Drop the name from the directory blocks and the link from its inode. An inode
+//with no links left is freed once nothing in memory refers to it.
+bool DirEntry::remove_child(const string &name){
+    if(!directory) return false;
+    Directory &d = *directory;
+    lock_guard<mutex> guard(d.lock);
+    load();
+    auto it = find_iter(name);
+    if(it == d.contents.end()) return false;
+
+    auto child = *it;
+    store->clear_record(*inode, child->slot);
+    d.dead_bytes += SuperBlock::record_size(child->name);
+    {
+        WriteGuard inode_guard(child->inode->lock);
+        child->inode->links--;
+        store->write_inode(*child->inode);
+    }
+
+    if(!d.index.empty()) d.index.erase(name);
+    d.contents.erase(it);
+
+    //once half the directory is dead records, write it out afresh
+    if(d.dead_bytes > Inode::block_size && 2 * d.dead_bytes > inode->size) compact();
+    return true;
+}
+
+bool DirEntry::retire(){
+    if(!directory) return false;
+    Directory &d = *directory;
+    lock_guard<mutex> guard(d.lock);
+    load();
+    if(d.removed || !d.contents.empty()) return false;
+    d.removed = true;
+    return true;
+}
+
+list<shared_ptr<DirEntry> > DirEntry::children() const{
+    if(!directory) return list<shared_ptr<DirEntry> >();
+    lock_guard<mutex> guard(directory->lock);
+    load();
+    return list<shared_ptr<DirEntry> >(directory->contents.begin(), directory->contents.end());
+}
+
+//a new inode's first blocks go near this directory's own
+void DirEntry::place_near(Inode &child) const{
+    lock_guard<mutex> guard(directory->lock);
+    child.goal = inode->goal_for(0);
+}
+
 shared_ptr<DirEntry> DirEntry::add_dir(const string name){
-    auto new_dir = make_dir(name, self.lock());
-    contents.push_back(new_dir);
-    return new_dir;
+    if(!directory) return nullptr;
+    auto new_inode = store->new_inode(true);
+    if(new_inode == nullptr) return nullptr;
+    place_near(*new_inode);
+    auto new_dir = make_dir(name, shared_from_this(), new_inode);
+    return add_entry(new_dir) ? new_dir : nullptr;
 }
 
 shared_ptr<DirEntry> DirEntry::add_file(const string name){
-    auto new_file = make_file(name, self.lock(), make_shared<Inode>());
-    contents.push_back(new_file);
-    return new_file;
+    if(!directory) return nullptr;
+    auto new_inode = store->new_inode(false);
+    if(new_inode == nullptr) return nullptr;
+    place_near(*new_inode);
+    auto new_file = make_file(name, shared_from_this(), new_inode);
+    return add_entry(new_file) ? new_file : nullptr;
 }
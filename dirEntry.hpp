@@ -1,14 +1,24 @@
 /*
 Every DirEntry class type object contains 
-1. block size
-2. the name of the file/directory
-3. type of the object - whether its a file or directory
-4. a pointer to its parent
-5. a pointer to itself
-6. a pointer to its inode 
-7. a list of pointers to all its contents.
-8. a boolean variable to check if the object is in use(locked) or not(unlocked)
-9. other create directory/file methods.
+1. the name of the file/directory
+2. type of the object - whether its a file or directory
+3. a pointer to its parent
+4. a pointer to its inode 
+5. a boolean variable to check if the object is in use(locked) or not(unlocked)
+6. the offset of its record in the parent's directory blocks
+7. for a directory only, its Directory part:
+	- a list of pointers to all its contents, in insertion order
+	- a hash index from name to position in contents, built once the directory
+	  grows past index_threshold entries so lookups and removals are O(1)
+	- a mutex guarding contents and the index; every method below takes it, so a
+	  directory can be searched and changed from several threads
+	- whether it was loaded: a directory read from the image is loaded from its blocks
+	  the first time it is used, and every change to contents is written to them straight away
+8. other create directory/file methods.
+A file's entry is only the fields every entry needs. Entries (with their reference
+counts) and the list nodes linking them into their directory come from slabs, so a
+name costs two slots (a directory one more) and no allocation of its own; a name of up
+to 15 bytes is held inside the std::string.
 */
 
 #ifndef _DIRENTRY_H_
@@ -16,34 +26,81 @@ Every DirEntry class type object contains
 
 #include "freeNode.hpp"
 #include "inode.hpp"
+#include "slab.hpp"
+#include "superBlock.hpp"
 
+#include <atomic>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <sys/types.h>
 
 enum EntryType {file, dir};
 
 class DirEntry : public std::enable_shared_from_this<DirEntry>{
-      DirEntry();
+      typedef std::list<std::shared_ptr<DirEntry>, SlabAllocator<std::shared_ptr<DirEntry> > > Contents;
+      typedef Contents::iterator ContentsIter;
+      typedef Contents::const_iterator ContentsConstIter;
+      static const uint index_threshold = 32;
+
+      //what only a directory has
+      struct Directory{
+          Contents contents;
+          std::unordered_map<std::string, ContentsIter> index;
+          std::mutex lock;
+          bool removed;
+          bool loaded;          //contents read from the directory blocks
+          uint dead_bytes;      //bytes of removed records left in the directory blocks
+          explicit Directory(bool loaded);
+          static void *operator new(size_t size) { return dir_slab.allocate(size); }
+          static void operator delete(void *p, size_t size) { dir_slab.deallocate(p, size); }
+      };
+      //lets make_dir and make_file, and nobody else, construct through allocate_shared
+      struct Token{};
+
+      mutable std::unique_ptr<Directory> directory;
+
+      void load() const;
+      void index_entry(ContentsIter it) const;
+      bool insert(const std::shared_ptr<DirEntry> &entry);
+      ContentsConstIter find_iter(const std::string &name) const;
+      void compact();
+      void place_near(Inode &child) const;
+      static std::shared_ptr<DirEntry> make(EntryType type, const std::string &name,
+                                            const std::shared_ptr<DirEntry> &parent,
+                                            const std::shared_ptr<Inode> &inode);
     public:
+      static SuperBlock *store;
+      static Slab entry_slab;       //DirEntry objects
+      static Slab link_slab;        //nodes of the contents lists
+      static Slab dir_slab;         //Directory parts
+
+      explicit DirEntry(Token);
       static std::shared_ptr<DirEntry> make_dir (const std::string name, 
-                                                 const std::shared_ptr<DirEntry> parent);
+                                                 const std::shared_ptr<DirEntry> parent,
+                                                 const std::shared_ptr<Inode> &inode);
       static std::shared_ptr<DirEntry> make_file(const std::string name,
                                                  const std::shared_ptr<DirEntry> parent,
-                                                 const std::shared_ptr<Inode> &inode = nullptr);
-      uint block_size;
+                                                 const std::shared_ptr<Inode> &inode);
       EntryType type;
+      std::atomic<bool> is_locked;
+      uint slot;                    //offset of this entry's record in the parent's directory blocks
       std::string name;
       std::weak_ptr<DirEntry> parent;
-      std::weak_ptr<DirEntry> self;
       std::shared_ptr<Inode> inode;
-      std::list<std::shared_ptr<DirEntry> > contents;
-      bool is_locked;
 
-      std::shared_ptr<DirEntry> find_child(const std::string name) const;
+      std::shared_ptr<DirEntry> find_child(const std::string &name) const;
+      //the add methods fail (nullptr/false) if the name exists, the directory was removed
+      //or there is no space left for the inode or the directory record
       std::shared_ptr<DirEntry> add_dir(const std::string name);
       std::shared_ptr<DirEntry> add_file(const std::string name);
+      bool add_entry(const std::shared_ptr<DirEntry> &entry);
+      bool remove_child(const std::string &name);
+      //mark an empty directory as removed so nothing can be added to it any more
+      bool retire();
+      std::list<std::shared_ptr<DirEntry> > children() const;
 };
 
 #endif 
@@ -1,15 +1,21 @@
 #include "fsImple.hpp"
 #include "dirEntry.hpp"
-#include "freeNode.hpp"
 #include "inode.hpp"
 
+#include <climits>
 #include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <iostream>
 #include <iomanip>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <deque>
 #include <assert.h>
@@ -35,71 +41,127 @@ using namespace std;
 FSImp::FSImp(const std::string &filename,
              const uint fs_size,
              const uint block_size,
-             const uint direct_blocks)
+             const uint cache_blocks,
+             const BlockDevice::Type device_type,
+             const IoEngine::Type engine_type,
+             const Journal::Config &journal_config)
 
         :filename(filename), 
          block_size(block_size), 
-         direct_blocks(direct_blocks),
-         num_blocks(ceil(static_cast<double>(fs_size)/block_size)){
+         num_blocks(ceil(static_cast<double>(fs_size)/block_size)),
+         device(BlockDevice::create(device_type, filename, num_blocks, block_size)),
+         engine(IoEngine::create(engine_type, *device, engine_depth)),
+         block_cache(*device, *engine, block_size, cache_blocks, cache_shards),
+         batch_window(max(1U, min(cache_blocks / cache_shards / 2, 256U))),
+         read_ahead(block_cache, block_size, max(1U, batch_window / 2)),
+         journal(*device, block_cache, block_size, journal_config),
+         allocator(num_blocks, allocator_shards),
+         store(block_cache, journal, allocator, block_size, num_blocks),
+         dentry_cache(dentry_cache_size),
+         next_descriptor(0),
+         write_buffer(default_write_buffer),
+         buffered_bytes(0),
+         buffered_writes(0),
+         buffer_flushes(0),
+         packed_reads(0),
+         packed_writes(0){
+            pick_geometry();
             Inode::block_size = block_size;
-            Inode::freeNode_list = &freeNode_list;
-            root_dir = DirEntry::make_dir("root", nullptr);
+            Inode::store = &store;
+            DirEntry::store = &store;
+            //mount the image, or lay out a new file system if it holds none
+            if (!store.mount()) {
+              store.format();
+            }
+            root_dir = DirEntry::make_dir("root", nullptr, store.get_inode(SuperBlock::root_ino));
             //setting rootdir
             pwd = root_dir;
-            init_disk(filename);
-            freeNode_list.emplace_back(num_blocks, 0);
     }
 
-FSImp::~FSImp(){
-    disk_file.close();
-    remove(filename.c_str());
+template <typename G>
+void FSImp::use_geometry(){
+    mapped_readv = &FSImp::readv_with<G>;
+    mapped_writev = &FSImp::writev_with<G>;
 }
 
-void FSImp::init_disk(const string &filename){
+//block sizes the file system is usually made with get loops that map offsets by shifting
+void FSImp::pick_geometry(){
+    switch(block_size){
+        case 512: use_geometry<Geometry<512> >(); break;
+        case 1024: use_geometry<Geometry<1024> >(); break;
+        case 2048: use_geometry<Geometry<2048> >(); break;
+        case 4096: use_geometry<Geometry<4096> >(); break;
+        case 8192: use_geometry<Geometry<8192> >(); break;
+        case 16384: use_geometry<Geometry<16384> >(); break;
+        case 32768: use_geometry<Geometry<32768> >(); break;
+        case 65536: use_geometry<Geometry<65536> >(); break;
+        default: use_geometry<RuntimeGeometry>(); break;
+    }
+}
 
-    const vector<char> zeroes(num_blocks);
+//the image is kept; the next FSImp on it mounts what is there
+FSImp::~FSImp(){
+    read_ahead.stop();
+    pwd.reset();
+    root_dir.reset();
+    store.unmount();
+    block_cache.sync();
+    device.reset();
+}
 
-    disk_file.open(filename, fstream::in | fstream::out | fstream::binary | fstream::trunc);
+//read, cat and cp reuse one buffer per thread so they do not allocate per call
+static thread_local vector<char> io_buffer;
 
-    for(uint i = 0; i < num_blocks; ++i){
-        disk_file.write(zeroes.data(), block_size);
-    }
+shared_ptr<DirEntry> FSImp::get_pwd() const{
+    lock_guard<mutex> guard(pwd_lock);
+    return pwd;
 }
 
-unique_ptr<FSImp::PathRet> FSImp::parse_path(string path_str) const{
+unique_ptr<FSImp::PathRet> FSImp::parse_path(const string &path_str) const{
     unique_ptr<PathRet> ret(new PathRet);
 
     //check if path is relative or absolute
-    ret->final_node = pwd;
+    auto start = get_pwd();
+    size_t pos = 0;
     if(path_str[0] == '/'){
-        path_str.erase(0,1);
-        ret->final_node = root_dir;
+        pos = 1;
+        start = root_dir;
+    }
+
+    DentryCache::Stamp stamp;
+    if(dentry_cache.lookup(start.get(), path_str, *ret, stamp)){
+        return ret;
     }
 
     //initialize data structure
-    ret->final_name = ret->final_node->name;
-    ret->parent_node = ret->final_node->parent.lock();
+    ret->final_node = start;
+    ret->final_name = start->name;
+    ret->parent_node = start->parent.lock();
 
-    //Extracting path based on hierarchy 
-    istringstream is(path_str);
+    //walk the path component by component, reusing one token buffer and skipping empty components
     string token;
-    vector<string> path_tokens;
-    while(getline(is, token, '/')){
-        path_tokens.push_back(token);
-    }
+    while(pos < path_str.size()){
+        size_t end = path_str.find('/', pos);
+        if(end == string::npos) end = path_str.size();
+        if(end == pos){
+            pos++;
+            continue;
+        }
 
-    //walk the path updating pointers of parent and child
-    for(auto &node_name : path_tokens){
         if(ret->final_node == nullptr){
             //the path has a nullptr before reaching the destination
             ret->invalid_path = true;
-            return ret;
+            break;
         }
 
+        token.assign(path_str, pos, end - pos);
         ret->parent_node = ret->final_node;
-        ret->final_node = ret->final_node->find_child(node_name);
-        ret->final_name = node_name;
+        ret->final_node = ret->final_node->find_child(token);
+        ret->final_name = token;
+        pos = end + 1;
     }
+
+    dentry_cache.insert(start.get(), path_str, *ret, stamp);
     return ret;
 }
 
@@ -111,231 +173,732 @@ bool FSImp::getMode(Mode *mode, string mode_s){
     return true;
 }
 
-bool FSImp::basic_open(Descriptor *d, vector<string> args){
-    assert(args.size() == 3);
-
-    Mode mode;
-
-    auto path = parse_path(args[1]);
+//Helper to open a file, creating it for mode W; desc is set on success
+int FSImp::basic_open(const string &path_str, Mode mode, shared_ptr<Descriptor> &desc){
+    auto path = parse_path(path_str);
     auto node = path->final_node;
     auto parent = path->parent_node;
-    bool known_mode = getMode(&mode, args[2]);
 
-    if(path->invalid_path == true){
-        cerr << args[0] << ": error: Invalid path: " << args[1] << endl;
-    }else if(!known_mode){
-        cerr << args[0] << ": error: Unknown mode: " << args[2] << endl;
-    }else if(node == nullptr && (mode == R || mode == RW)){
-        cerr << args[0] << ": error: " << args[1] << " does not exist." << endl;
-    }else if(node != nullptr && node->type == dir){
-        cerr << args[0] << ": error: Cannot open a directory." << endl;
-    }else if(node != nullptr && node->is_locked){
-        cerr << args[0] << ": error: " << args[1] << " is already open." << endl;
-    }else{
-        //create the file if necessary
-        if(node == nullptr){
-            node = parent->add_file(path->final_name);
-        } 
-
-        //get a  descriptor
-        uint fd = next_descriptor++;
-        node->is_locked = true;
-        *d = Descriptor{mode, 0, node->inode, node, fd};
-        open_files[fd] = *d;
+    if(path->invalid_path) return -ENOENT;
+    if(node == nullptr && (mode == R || mode == RW)) return -ENOENT;
+    if(node != nullptr && node->type == dir) return -EISDIR;
+    if(node != nullptr && node->is_locked) return -EBUSY;
+    if(node == nullptr && path->final_name.size() > SuperBlock::max_name) return -ENAMETOOLONG;
+
+    //create the file if necessary; another thread may have created it first
+    if(node == nullptr){
+        Journal::Op op(journal);
+        node = parent->add_file(path->final_name);
+        if(node != nullptr){
+            dentry_cache.name_created();
+        } else{
+            node = parent->find_child(path->final_name);
+            if(node == nullptr) return -ENOSPC;
+        }
+        if(node->type == dir) return -EISDIR;
+    }
 
-        return true;
+    //claim the file; only one descriptor may have it open
+    bool was_locked = false;
+    if(!node->is_locked.compare_exchange_strong(was_locked, true)) return -EBUSY;
+
+    //get a  descriptor
+    shared_ptr<Descriptor> d(new Descriptor());
+    d->mode = mode;
+    d->byte_pos = 0;
+    d->inode = node->inode;
+    d->from = node;
+    d->fd = next_descriptor++;
+
+    FdShard &shard = open_files[d->fd % fd_shards];
+    lock_guard<mutex> guard(shard.lock);
+    shard.files[d->fd] = d;
+    desc = d;
+    return d->fd;
+}
+
+int FSImp::open(const string &path, Mode mode){
+    shared_ptr<Descriptor> desc;
+    return basic_open(path, mode, desc);
+}
+
+//Helper to pass size bytes of an open file, from its position on, to sink one chunk at a
+//time. A reader thread fills one of two stream_chunk buffers while sink takes the other,
+//so memory stays at two chunks whatever the size; a file of one chunk is read in place.
+//sink returns false to stop early, and then so does stream.
+bool FSImp::stream(Descriptor &src, uint size, const function<bool(const char *, uint)> &sink){
+    if(size <= stream_chunk){
+        if(io_buffer.size() < size) io_buffer.resize(size);
+        basic_read(src, io_buffer.data(), size);
+        return sink(io_buffer.data(), size);
     }
 
-    return false;
+    struct Slot{
+        vector<char> data;
+        uint len = 0;
+        bool full = false;
+    };
+    Slot slots[2];
+    mutex lock;
+    condition_variable changed;
+    bool stopping = false;
+    exception_ptr failure;
+
+    thread reader([&]{
+        try{
+            uint left = size;
+            for(uint n = 0; left > 0; n ^= 1){
+                Slot &slot = slots[n];
+                {
+                    unique_lock<mutex> guard(lock);
+                    changed.wait(guard, [&]{ return stopping || !slot.full; });
+                    if(stopping) return;
+                }
+                uint len = min(left, static_cast<uint>(stream_chunk));
+                slot.data.resize(stream_chunk);
+                basic_read(src, slot.data.data(), len);
+                left -= len;
+                {
+                    lock_guard<mutex> guard(lock);
+                    slot.len = len;
+                    slot.full = true;
+                }
+                changed.notify_all();
+            }
+        } catch(...){
+            //the chunk that failed is never filled; wake the consumer to see why
+            lock_guard<mutex> guard(lock);
+            failure = current_exception();
+            stopping = true;
+            changed.notify_all();
+        }
+    });
+
+    bool ok = true;
+    uint left = size;
+    for(uint n = 0; ok && left > 0; n ^= 1){
+        Slot &slot = slots[n];
+        {
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [&]{ return stopping || slot.full; });
+            if(!slot.full) break;
+        }
+        ok = sink(slot.data.data(), slot.len);
+        left -= slot.len;
+        {
+            lock_guard<mutex> guard(lock);
+            slot.full = false;
+            if(!ok) stopping = true;
+        }
+        changed.notify_all();
+    }
+    reader.join();
+    if(failure) rethrow_exception(failure);
+    return ok;
+}
+
+//print why a command failed
+static void report(const string &cmd, const string &what, int code){
+    cerr << cmd << ": error: " << what << ": " << strerror(-code) << endl;
 }
 
 void FSImp::open(vector<string> args){
     ops_exactly(2);
-    Descriptor desc;
-    if(basic_open(&desc, args)){
-        cout << "SUCCESS: fd = " << desc.fd << endl;
+    Mode mode;
+    if(!getMode(&mode, args[2])){
+        cerr << args[0] << ": error: Unknown mode: " << args[2] << endl;
+        return;
+    }
+    int fd = open(args[1], mode);
+    if(fd < 0){
+        report(args[0], args[1], fd);
+    } else{
+        cout << "SUCCESS: fd = " << fd << endl;
     }
 }
 
-unique_ptr<string> FSImp::basic_read(Descriptor &desc, const uint size){
-    char *data = new char[size];
-    char *data_p = data;
-    uint &pos = desc.byte_pos;
-    uint bytes_to_read = size;
+shared_ptr<FSImp::Descriptor> FSImp::find_descriptor(uint fd){
+    FdShard &shard = open_files[fd % fd_shards];
+    lock_guard<mutex> guard(shard.lock);
+    auto kv = shard.files.find(fd);
+    return kv == shard.files.end() ? nullptr : kv->second;
+}
+
+//size of an open file, read under its inode lock, counting the bytes its descriptor holds back
+uint FSImp::file_size(Descriptor &desc){
     auto inode = desc.inode.lock();
+    ReadGuard guard(inode->lock);
+    if (desc.pending.empty()) return inode->size;
+    return max(inode->size, desc.pending_pos + static_cast<uint>(desc.pending.size()));
+}
 
-    uint dbytes = direct_blocks * block_size;
+//Helper to read from an open file straight into the caller's buffers, one iovec after another
+uint FSImp::basic_readv(Descriptor &desc, const struct iovec *iov, int iovcnt){
+    return (this->*mapped_readv)(desc, iov, iovcnt);
+}
 
-    while (bytes_to_read > 0) {
-    uint read_size = min(bytes_to_read, block_size - pos % block_size);
-    uint read_src;
-    if (pos < dbytes) {
-      read_src = inode->data_blocks[pos / block_size] + pos % block_size;
-    } else {
-      uint i = (pos - dbytes) / (direct_blocks * block_size);
-      uint j = (pos - dbytes) / block_size % direct_blocks;
-      read_src = inode->inode_blocks->at(i)[j] + pos % block_size;
+template <typename G>
+uint FSImp::readv_with(Descriptor &desc, const struct iovec *iov, int iovcnt){
+    const G geo(block_size);
+    uint &pos = desc.byte_pos;
+    const uint start = pos;
+    uint bytes_read = 0;
+    auto inode = desc.inode.lock();
+    ReadGuard guard(inode->lock);
+
+    //a packed file's bytes are in memory with its inode
+    if(inode->packed){
+        const vector<char> &data = inode->packed->data;
+        for(int v = 0; v < iovcnt; v++){
+            char *data_p = static_cast<char *>(iov[v].iov_base);
+            uint len = iov[v].iov_len;
+            uint have = pos < data.size() ? min(len, static_cast<uint>(data.size()) - pos) : 0;
+            memcpy(data_p, data.data() + pos, have);
+            memset(data_p + have, 0, len - have);
+            pos += len;
+            bytes_read += len;
+        }
+        packed_reads++;
+        return bytes_read;
     }
-    disk_file.seekp(read_src);
-    disk_file.read(data_p, read_size);
-    pos += read_size;
-    data_p += read_size;
-    bytes_to_read -= read_size;
+
+    //large reads fetch a window of blocks ahead of the copy in one engine batch
+    uint total = 0;
+    for(int v = 0; v < iovcnt; v++) total += iov[v].iov_len;
+    uint end = pos + total;
+    uint prefetched = total >= batch_threshold * block_size ? pos : end;
+    vector<pair<off_t, size_t> > ranges;
+
+    for(int v = 0; v < iovcnt; v++){
+        char *data_p = static_cast<char *>(iov[v].iov_base);
+        uint bytes_to_read = iov[v].iov_len;
+
+        //one cache read per physically contiguous piece of the file
+        while (bytes_to_read > 0) {
+            if (pos >= prefetched) {
+                uint window = min(end - pos, static_cast<uint>(geo.bytes(batch_window)) - geo.offset(pos));
+                inode->image_ranges(geo, pos, window, ranges);
+                block_cache.prefetch(ranges);
+                prefetched = pos + window;
+            }
+            uint contiguous;
+            uint block = inode->map_block(geo.block(pos), &contiguous);
+            uint read_size = min(static_cast<unsigned long>(bytes_to_read),
+                                 geo.bytes(contiguous) - geo.offset(pos));
+            if (block == Inode::hole) {
+              //a hole reads as zeroes without touching the cache or the device
+              memset(data_p, 0, read_size);
+            } else {
+              block_cache.read(geo.image(block, pos), data_p, read_size);
+            }
+            pos += read_size;
+            data_p += read_size;
+            bytes_to_read -= read_size;
+            bytes_read += read_size;
+        }
+    }
+    read_ahead.note(desc.ahead, inode, start, bytes_read, inode->size);
+    return bytes_read;
+}
+
+uint FSImp::basic_read(Descriptor &desc, char *data, const uint size){
+    struct iovec iov = {data, size};
+    return basic_readv(desc, &iov, 1);
+}
+
+ssize_t FSImp::read(int fd, void *buf, size_t count) {
+  auto desc = fd < 0 ? nullptr : find_descriptor(fd);
+  return desc == nullptr ? -EBADF : read(*desc, buf, count);
+}
+
+ssize_t FSImp::read(Descriptor &desc, void *buf, size_t count) {
+  if (desc.mode == W) {
+    return -EBADF;
   }
-  return unique_ptr<string>(new string(data, size));
+  lock_guard<mutex> desc_guard(desc.lock);
+  if (!flush_pending(desc)) {
+    return -ENOSPC;
+  }
+  uint size = file_size(desc);
+  if (desc.byte_pos >= size) {
+    return 0;
+  }
+  uint len = min(count, static_cast<size_t>(size - desc.byte_pos));
+  return basic_read(desc, static_cast<char *>(buf), len);
 }
 
 void FSImp::read(vector<string> args) {
   ops_exactly(2);
 
-  uint fd;
-
-  //check if the file descriptor valid
-  if ( !(istringstream(args[1]) >> fd)) {
+  uint fd, size;
+  if (!(istringstream(args[1]) >> fd)) {
     cerr << "read: error: Unknown descriptor." << endl;
     return;
   }
-  //check if the file descriptor is open
-  auto desc_it = open_files.find(fd);
-  if (desc_it == open_files.end()) {
-    cerr << "read: error: File descriptor not open." << endl;
-    return;
-  }
-  
-  //check if read access if given to the file
-  auto &desc = desc_it->second;
-  if(desc.mode != R && desc.mode != RW) {
-    cerr << "read: error: " << args[1] << " not open for read." << endl;
+  if (!(istringstream(args[2]) >> size)) {
+    cerr << "read: error: Invalid read size." << endl;
     return;
   }
 
-  //read data from the file
-  uint size;
-  if (!(istringstream(args[2]) >> size)) {
-    cerr << "read: error: Invalid read size." << endl;
-  } else if (size + desc.byte_pos > desc.inode.lock()->size) {
+  Stat st;
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  int rc = pos < 0 ? pos : fstat(fd, st);
+  if (rc < 0) {
+    report(args[0], args[1], rc);
+  } else if (pos + size > st.size) {
     cerr << "read: error: Read goes beyond file end." << endl;
   } else {
-    auto data = basic_read(desc, size);
-    cout << *data << endl;
+    if (io_buffer.size() < size) io_buffer.resize(size);
+    ssize_t got = read(fd, io_buffer.data(), size);
+    if (got < 0) {
+      report(args[0], args[1], got);
+    } else {
+      cout.write(io_buffer.data(), got) << endl;
+    }
+  }
+}
+
+//move the byte position of an open file; past the end is allowed and a write
+//there leaves a hole behind it
+off_t FSImp::lseek(int fd, off_t offset, int whence) {
+  auto desc = fd < 0 ? nullptr : find_descriptor(fd);
+  return desc == nullptr ? -EBADF : lseek(*desc, offset, whence);
+}
+
+off_t FSImp::lseek(Descriptor &desc, off_t offset, int whence) {
+  lock_guard<mutex> desc_guard(desc.lock);
+  off_t base;
+  if (whence == SEEK_SET) {
+    base = 0;
+  } else if (whence == SEEK_CUR) {
+    base = desc.byte_pos;
+  } else if (whence == SEEK_END) {
+    base = file_size(desc);
+  } else {
+    return -EINVAL;
+  }
+  off_t pos = base + offset;
+  if (pos < 0 || pos > UINT_MAX) {
+    return -EINVAL;
+  }
+  //a seek elsewhere ends a sequential run; asking where the descriptor is does not
+  if (static_cast<uint>(pos) != desc.byte_pos) {
+    ReadAhead::reset(desc.ahead, pos);
+  }
+  desc.byte_pos = pos;
+  return pos;
+}
+
+void FSImp::seek(vector<string> args) {
+  ops_exactly(2);
+
+  uint fd, pos;
+  if (!(istringstream(args[1]) >> fd)) {
+    cerr << "seek: error: Unknown descriptor." << endl;
+  } else if (!(istringstream(args[2]) >> pos)) {
+    cerr << "seek: error: Invalid position." << endl;
+  } else {
+    off_t rc = lseek(fd, pos, SEEK_SET);
+    if (rc < 0) report(args[0], args[1], rc);
   }
 }
 
-//Helper to write to an open file based on descriptor 
-uint FSImp::basic_write(Descriptor &desc, const string data) {
-  const char *bytes = data.c_str();
+//Helper to write to an open file based on descriptor, gathering the data from each iovec in turn
+uint FSImp::basic_writev(Descriptor &desc, const struct iovec *iov, int iovcnt) {
+  return (this->*mapped_writev)(desc, iov, iovcnt);
+}
+
+template <typename G>
+uint FSImp::writev_with(Descriptor &desc, const struct iovec *iov, int iovcnt) {
+  const G geo(block_size);
   uint &pos = desc.byte_pos;
-  uint bytes_to_write = data.size();
+  uint bytes_to_write = 0;
   uint bytes_written = 0;
+  for (int v = 0; v < iovcnt; v++) {
+    bytes_to_write += iov[v].iov_len;
+  }
   auto inode = desc.inode.lock();
+  Journal::Op op(journal);
+  WriteGuard guard(inode->lock);
   uint &file_size = inode->size;
-  uint &file_blocks_used = inode->blocks_used;
   uint new_size = max(file_size, pos + bytes_to_write);
-  uint new_blocks_used = ceil(static_cast<double>(new_size)/block_size);
-  uint blocks_needed = new_blocks_used - file_blocks_used;
-  uint dbytes = direct_blocks * block_size;
-
-  // expand the inode to indirect blocks if needed
-  if (blocks_needed && blocks_needed + file_blocks_used > 2) {
-    uint ivec_used = (ceil(min(file_blocks_used - 2, 0U) / static_cast<float>(direct_blocks)));
-    uint ivec_new = (ceil((new_blocks_used - 2) / static_cast<float>(direct_blocks)));
-    while (ivec_used < ivec_new) {
-      inode->inode_blocks->push_back(vector<uint>());
-      ivec_used++;
-    }
-  }
-
-  // find space
-  vector<pair<uint, uint>> free_chunks;
-  auto fl_it = freeNode_list.begin();
-  while (blocks_needed > 0) {
-    if (fl_it == freeNode_list.end()) {
-      // 0 return because we ran out of free space
-      return 0;}
-    if (fl_it->num_blocks > blocks_needed) {
-      // we found a chunk big enough to hold the rest of our write
-      free_chunks.push_back(make_pair(fl_it->pos, blocks_needed));
-      fl_it->pos += blocks_needed * block_size; //adjust position in the freeNode_list list.
-      fl_it->num_blocks -= blocks_needed;   //number of free blocks
-      break;
-    }
-    // we have a chunk, but will fill it and need more
-    free_chunks.push_back((make_pair(fl_it->pos, fl_it->num_blocks)));
-    blocks_needed -= fl_it->num_blocks;
-    auto used_entry = fl_it++;
-    freeNode_list.erase(used_entry);
-  }
-
-  // allocate our blocks
-  for (auto fc_it : free_chunks) {
-    uint block_pos = fc_it.first;
-    uint num_blocks = fc_it.second;
-    for (uint k = 0; k < num_blocks; ++k, ++file_blocks_used, block_pos += block_size) {
-      if (file_blocks_used < direct_blocks) {
-        inode->data_blocks.push_back(block_pos); //add the current data block position
-      } else {
-        uint i = ((file_blocks_used - direct_blocks) / direct_blocks);
-        inode->inode_blocks->at(i).push_back(block_pos);    // add the current inode block position
-      }
+
+  // a small file keeps its bytes in its inode or a shared tail block until it outgrows them
+  if (store.can_pack(*inode, new_size)) {
+    vector<char> gathered;
+    for (int v = 0; v < iovcnt; v++) {
+      const char *bytes = static_cast<const char *>(iov[v].iov_base);
+      gathered.insert(gathered.end(), bytes, bytes + iov[v].iov_len);
+    }
+    if (!store.write_packed(*inode, pos, gathered.data(), bytes_to_write)) {
+      return 0;
     }
+    pos += bytes_to_write;
+    packed_writes++;
+    return bytes_to_write;
+  }
+  if (!store.unpack(*inode)) {
+    return 0;
   }
 
-  // actually write our blocks
-  while (bytes_to_write > 0) {
-    uint write_size = min(block_size - pos % block_size, bytes_to_write);
-    uint write_dest = 0;
-    if (pos < dbytes) {
-      write_dest = inode->data_blocks[pos / block_size] + pos % block_size;
-    } else {
-      uint i = (pos - dbytes) / (direct_blocks * block_size);
-      uint j = (pos - dbytes) / block_size % direct_blocks;
-      write_dest = inode->inode_blocks->at(i)[j] + pos % block_size;
+  // blocks still shared with a copy get their own before they change
+  if (!store.unshare(*inode, pos, bytes_to_write)) {
+    return 0;
+  }
+
+  // allocate blocks for the holes the write lands in, past the end or not;
+  // anything it skips over stays a hole
+  vector<pair<uint, uint> > filled;
+  uint first_block = geo.block(pos);
+  uint end_block = geo.blocks(static_cast<unsigned long>(pos) + bytes_to_write);
+  if (!store.fill_holes(*inode, first_block, end_block, filled)) {
+    // 0 return because we ran out of free space
+    return 0;
+  }
+  uint next_filled = 0;
+
+  //large writes push each finished window of blocks out in one engine batch
+  bool batched = bytes_to_write >= batch_threshold * block_size;
+  uint written_back = pos;
+  vector<pair<off_t, size_t> > ranges;
+
+  // actually write our blocks, one cache write per physically contiguous piece
+  for (int v = 0; v < iovcnt; v++) {
+    const char *bytes = static_cast<const char *>(iov[v].iov_base);
+    uint iov_left = iov[v].iov_len;
+    while (iov_left > 0) {
+      uint contiguous;
+      uint lblock = geo.block(pos);
+      uint block = inode->map_block(lblock, &contiguous);
+      // blocks that were holes are fresh: a partial write into one starts from zeroes
+      while (next_filled < filled.size() && filled[next_filled].first + filled[next_filled].second <= lblock) {
+        next_filled++;
+      }
+      bool fresh = next_filled < filled.size() && filled[next_filled].first <= lblock;
+      if (fresh) {
+        contiguous = min(contiguous, filled[next_filled].first + filled[next_filled].second - lblock);
+      } else if (next_filled < filled.size()) {
+        contiguous = min(contiguous, filled[next_filled].first - lblock);
+      }
+      uint write_size = min(geo.bytes(contiguous) - geo.offset(pos), static_cast<unsigned long>(iov_left));
+      block_cache.write(geo.image(block, pos), bytes, write_size, fresh);
+      bytes += write_size;
+      bytes_written += write_size;
+      iov_left -= write_size;
+      pos += write_size;
+      if (batched && (pos - written_back >= geo.bytes(batch_window) || bytes_written == bytes_to_write)) {
+        inode->image_ranges(geo, written_back, pos - written_back, ranges);
+        block_cache.write_behind(ranges);
+        written_back = pos;
+      }
     }
-    disk_file.seekp(write_dest);
-    disk_file.write(bytes + bytes_written, write_size);
-    bytes_written += write_size;
-    bytes_to_write -= write_size;
-    pos += write_size;
   }
 
-  disk_file.flush();
   file_size = new_size;
+  if (!store.write_inode(*inode)) {
+    return 0;
+  }
   return bytes_written;
 }
 
+uint FSImp::basic_write(Descriptor &desc, const char *data, const uint size) {
+  struct iovec iov = {const_cast<char *>(data), size};
+  return basic_writev(desc, &iov, 1);
+}
+
+ssize_t FSImp::write(int fd, const void *buf, size_t count) {
+  auto desc = fd < 0 ? nullptr : find_descriptor(fd);
+  return desc == nullptr ? -EBADF : write(*desc, buf, count, write_buffer);
+}
+
+ssize_t FSImp::write(Descriptor &desc, const void *buf, size_t count, uint limit) {
+  if (desc.mode == R) {
+    return -EBADF;
+  }
+  lock_guard<mutex> desc_guard(desc.lock);
+  if (count > UINT_MAX - desc.byte_pos) {
+    return -EFBIG;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  uint written = buffered_write(desc, static_cast<const char *>(buf), count, limit);
+  return written == 0 ? -ENOSPC : written;
+}
+
 //Write to the file
 void FSImp::write(vector<string> args) {
   ops_exactly(2);
 
   uint fd;
-  //check for limit on the file size
-  uint max_size = block_size * (direct_blocks + direct_blocks * direct_blocks);
-  if ( !(istringstream(args[1]) >> fd)) {
+  if (!(istringstream(args[1]) >> fd)) {
     cerr << "write: error: Unknown descriptor." << endl;
   } else {
-    auto desc = open_files.find(fd);
-    if (desc == open_files.end()) {
-      cerr << "write: error: File descriptor not open." << endl;
-    } else if (desc->second.mode != W && desc->second.mode != RW) {
-      cerr << "write: error: " << args[1] << " not open for write." << endl;
-    } else if (desc->second.byte_pos + args[2].size() > max_size) {
-      cerr << "write: error: File to large for inode." << endl;
-    } else if (!basic_write(desc->second, args[2])) {
-      cerr << "write: error: Insufficient disk space." << endl;
+    ssize_t rc = write(fd, args[2].data(), args[2].size());
+    if (rc < 0) report(args[0], args[1], rc);
+  }
+}
+
+//Helper to give a descriptor's held back bytes to the file in one write, so a run of
+//small appends gets one run of blocks; the descriptor's lock must be held
+bool FSImp::flush_pending(Descriptor &desc) {
+  if (desc.pending.empty()) {
+    return true;
+  }
+  uint size = desc.pending.size();
+  uint pos = desc.byte_pos;
+  desc.byte_pos = desc.pending_pos;
+  bool written = basic_write(desc, desc.pending.data(), size) == size;
+  desc.byte_pos = pos;
+  desc.pending.clear();
+  buffered_bytes -= size;
+  buffer_flushes++;
+  return written;
+}
+
+//Helper to hold a write back in the descriptor's buffer if it continues the buffered bytes
+//and fits in limit; otherwise the buffer is flushed first, and a write as large as limit goes
+//straight to the file. 0 if the space ran out.
+uint FSImp::buffered_write(Descriptor &desc, const char *data, uint size, uint limit) {
+  bool follows = desc.pending.empty() || desc.byte_pos == desc.pending_pos + desc.pending.size();
+  if (!follows || desc.pending.size() + size > limit || buffered_bytes + size > buffer_budget) {
+    if (!flush_pending(desc)) {
+      return 0;
     }
   }
+  if (size >= limit || buffered_bytes + size > buffer_budget) {
+    return basic_write(desc, data, size);
+  }
+
+  if (desc.pending.empty()) {
+    desc.pending_pos = desc.byte_pos;
+  }
+  desc.pending.insert(desc.pending.end(), data, data + size);
+  desc.byte_pos += size;
+  buffered_bytes += size;
+  buffered_writes++;
+  return size;
 }
 
-//Helper to remove the file from open_files map and unlock it so that file can be accessed by other processes
-bool FSImp::basic_close(uint fd) {
-  auto kv = open_files.find(fd);
-  if(kv == open_files.end()) {
+//Helper to allocate the blocks under bytes [offset, offset + length) of an open file up front,
+//as contiguously as the free space allows; the file grows to cover them and they read as zeroes
+bool FSImp::basic_fallocate(Descriptor &desc, uint offset, uint length) {
+  auto inode = desc.inode.lock();
+  Journal::Op op(journal);
+  WriteGuard guard(inode->lock);
+  if (!store.unpack(*inode)) {
+    return false;
+  }
+  RuntimeGeometry geo(block_size);
+  uint first_block = geo.block(offset);
+  uint end_block = geo.blocks(static_cast<unsigned long>(offset) + length);
+  if (!store.preallocate(*inode, first_block, end_block)) {
     return false;
+  }
+  inode->size = max(inode->size, offset + length);
+  return store.write_inode(*inode);
+}
+
+int FSImp::fallocate(int fd, off_t offset, off_t length) {
+  auto desc = fd < 0 ? nullptr : find_descriptor(fd);
+  return desc == nullptr ? -EBADF : fallocate(*desc, offset, length);
+}
+
+int FSImp::fallocate(Descriptor &desc, off_t offset, off_t length) {
+  if (desc.mode == R) {
+    return -EBADF;
+  }
+  if (offset < 0 || length <= 0) {
+    return -EINVAL;
+  }
+  if (offset + length > UINT_MAX) {
+    return -EFBIG;
+  }
+  lock_guard<mutex> desc_guard(desc.lock);
+  return flush_pending(desc) && basic_fallocate(desc, offset, length) ? 0 : -ENOSPC;
+}
+
+//Reserve space in a file: fallocate <fd> <offset> <length>
+void FSImp::fallocate(vector<string> args) {
+  ops_exactly(3);
+
+  uint fd, offset, length;
+  if (!(istringstream(args[1]) >> fd)) {
+    cerr << "fallocate: error: Unknown descriptor." << endl;
+  } else if (!(istringstream(args[2]) >> offset) || !(istringstream(args[3]) >> length)) {
+    cerr << "fallocate: error: Invalid offset or length." << endl;
+  } else {
+    int rc = fallocate(fd, offset, length);
+    if (rc < 0) report(args[0], args[1], rc);
+  }
+}
+
+//Helper to remove the file from open_files map and unlock it so that file can be accessed by other processes
+//Helper to close a descriptor. Unless deferred is given, what was written through it is made
+//durable before it returns; otherwise it is added to deferred for a later settle.
+int FSImp::basic_close(uint fd, vector<shared_ptr<Descriptor> > *deferred) {
+  shared_ptr<Descriptor> desc;
+  {
+    FdShard &shard = open_files[fd % fd_shards];
+    lock_guard<mutex> guard(shard.lock);
+    auto kv = shard.files.find(fd);
+    if (kv == shard.files.end()) {
+      return -EBADF;
+    }
+    desc = kv->second;
+    shard.files.erase(kv);
+  }
+
+  //held back writes reach the file before it is given up
+  int rc = 0;
+  {
+    lock_guard<mutex> desc_guard(desc->lock);
+    if (!flush_pending(*desc)) {
+      rc = -ENOSPC;
+    }
+  }
+
+  desc->from.lock()->is_locked = false;
+  if (deferred) {
+    deferred->push_back(desc);
   } else {
-    kv->second.from.lock()->is_locked = false;
-    open_files.erase(fd);
+    settle({desc});
+  }
+  return rc;
+}
+
+//Helper to make what was written through closed descriptors durable, with one commit for all
+void FSImp::settle(const vector<shared_ptr<Descriptor> > &closed) {
+  if (closed.empty()) {
+    return;
+  }
+  if (!journal.enabled()) {
+    block_cache.sync();
+    return;
   }
-  return true;
+  bool written = false;
+  vector<pair<off_t, size_t> > ranges;
+  for (auto &desc : closed) {
+    if (desc->mode == R) {
+      continue;
+    }
+    //only these files' data goes out; the commit syncs it along with the metadata
+    auto inode = desc->inode.lock();
+    {
+      ReadGuard guard(inode->lock);
+      inode->image_ranges(0, inode->size, ranges);
+    }
+    block_cache.write_behind(ranges);
+    written = true;
+  }
+  if (written) {
+    journal.commit();
+  }
+}
+
+//Each op finds its descriptor once: the current one, one opened earlier in the compound or
+//one looked up the first time its fd comes up. A stat of a path the compound opened uses
+//the descriptor instead of resolving the path again. Writes gather in their descriptor
+//whatever the write buffer size, so a file written in many pieces is allocated in one
+//pass when it is closed or next flushed, and closes leave the commit to the end.
+//If an op fails, the files the compound opened and has not closed are closed.
+int FSImp::compound(const vector<CompoundOp> &ops, vector<ssize_t> &results) {
+  results.clear();
+  shared_ptr<Descriptor> current;
+  map<int, shared_ptr<Descriptor> > descs;
+  map<string, shared_ptr<Descriptor> > opened;
+  vector<shared_ptr<Descriptor> > closed;
+  int rc = 0;
+  {
+    Journal::Op op(journal);
+    for (auto &cop : ops) {
+      shared_ptr<Descriptor> desc;
+      if (cop.fd == CompoundOp::current) {
+        desc = current;
+      } else if (cop.fd >= 0) {
+        auto known = descs.find(cop.fd);
+        if (known != descs.end()) {
+          desc = known->second;
+        } else if ((desc = find_descriptor(cop.fd)) != nullptr) {
+          descs[cop.fd] = desc;
+        }
+      }
+      bool needs_desc = cop.type != CompoundOp::open_op && cop.type != CompoundOp::mkdir_op &&
+                        cop.type != CompoundOp::unlink_op && (cop.type != CompoundOp::stat_op || cop.path.empty());
+
+      ssize_t result;
+      if (needs_desc && desc == nullptr) {
+        result = -EBADF;
+      } else {
+        switch (cop.type) {
+          case CompoundOp::open_op:
+            result = basic_open(cop.path, cop.mode, desc);
+            if (result >= 0) {
+              current = desc;
+              descs[result] = desc;
+              opened[cop.path] = desc;
+            }
+            break;
+          case CompoundOp::write_op:
+            result = write(*desc, cop.data, cop.count, UINT_MAX);
+            break;
+          case CompoundOp::read_op:
+            result = read(*desc, cop.buf, cop.count);
+            break;
+          case CompoundOp::seek_op:
+            result = lseek(*desc, cop.offset, cop.whence);
+            break;
+          case CompoundOp::fallocate_op:
+            result = fallocate(*desc, cop.offset, cop.count);
+            break;
+          case CompoundOp::close_op:
+            result = basic_close(desc->fd, &closed);
+            descs.erase(desc->fd);
+            for (auto kv = opened.begin(); kv != opened.end();) {
+              kv = kv->second == desc ? opened.erase(kv) : next(kv);
+            }
+            if (current == desc) {
+              current.reset();
+            }
+            break;
+          case CompoundOp::stat_op:
+            if (cop.path.empty()) {
+              result = fstat(*desc, *cop.st);
+            } else if (opened.count(cop.path)) {
+              result = fstat(*opened[cop.path], *cop.st);
+            } else {
+              result = stat(cop.path, *cop.st);
+            }
+            break;
+          case CompoundOp::mkdir_op:
+            result = mkdir(cop.path);
+            break;
+          case CompoundOp::unlink_op:
+            result = unlink(cop.path);
+            break;
+          default:
+            result = -EINVAL;
+        }
+      }
+      results.push_back(result);
+      if (result < 0) {
+        rc = result;
+        break;
+      }
+    }
+    //a failed compound does not leave behind the files it opened
+    if (rc < 0) {
+      for (auto &kv : opened) {
+        basic_close(kv.second->fd, &closed);
+      }
+    }
+  }
+  settle(closed);
+  return rc;
+}
+
+int FSImp::close(int fd) {
+  return fd < 0 ? -EBADF : basic_close(fd);
 }
 
 //close the file using helper function.
@@ -346,38 +909,65 @@ void FSImp::close(vector<string> args) {
   if (! (istringstream (args[1]) >> fd)) {
     cerr << "close: error: File descriptor not recognized" << endl;
   } else {
-    if (!basic_close(fd)) {
-      cerr << "close: error: File descriptor not open" << endl;
+    int rc = close(fd);
+    if (rc < 0) {
+      report(args[0], args[1], rc);
     } else {
       cout << "closed " << fd << endl;
     }
   }
 }
 
+int FSImp::mkdir(const string &path_str) {
+  auto path = parse_path(path_str);
+  auto dirname = path->final_name;
+  auto parent = path->parent_node;
+
+  if (path->invalid_path) {
+    return -ENOENT;
+  } else if (path->final_node != nullptr) {
+    return -EEXIST;
+  } else if (dirname.size() > SuperBlock::max_name) {
+    return -ENAMETOOLONG;
+  }
+
+  /* actually add the directory; another thread may have beaten us to it */
+  Journal::Op op(journal);
+  if (parent->add_dir(dirname) == nullptr) {
+    return parent->find_child(dirname) != nullptr ? -EEXIST : -ENOSPC;
+  }
+  dentry_cache.name_created();
+  return 0;
+}
+
 //create directory.
 void FSImp::mkdir(vector<string> args) {
   ops_at_least(1);
   /* add each new directory one at a time */
   for (uint i = 1; i < args.size(); i++) {
-    auto path = parse_path(args[i]);
-    auto node = path->final_node;
-    auto dirname = path->final_name;
-    auto parent = path->parent_node;
+    int rc = mkdir(args[i]);
+    if (rc < 0) report(args[0], args[i], rc);
+  }
+}
 
-    if (path->invalid_path) {
-      cerr << "mkdir: error: Invalid path: " << args[i] << endl;
-      return;
-    } else if (node == root_dir) {
-      cerr << "mkdir: error: Cannot recreate root." << endl;
-      return;
-    } else if (node != nullptr) {
-      cerr << "mkdir: error: " << args[i] << " already exists." << endl;
-      continue;
-    }
+int FSImp::rmdir(const string &path_str) {
+  auto path = parse_path(path_str);
+  auto node = path->final_node;
+  auto parent = path->parent_node;
 
-    /* actually add the directory */
-    parent->add_dir(dirname);
+  if (node == nullptr) {
+    return -ENOENT;
+  } else if (node == root_dir || node == get_pwd()) {
+    return -EBUSY;
+  } else if (node->type != dir) {
+    return -ENOTDIR;
+  } else if (!node->retire()) {
+    return -ENOTEMPTY;
   }
+  Journal::Op op(journal);
+  parent->remove_child(node->name);
+  dentry_cache.name_removed();
+  return 0;
 }
 
 //Get the directory name and its parent.
@@ -385,23 +975,8 @@ void FSImp::rmdir(vector<string> args) {
   ops_at_least(1);
 
   for (uint i = 1; i < args.size(); i++) {
-    auto path = parse_path(args[i]);
-    auto node = path->final_node;
-    auto parent = path->parent_node;
-
-    if (node == nullptr) {
-      cerr << "rmdir: error: Invalid path: " << args[i] << endl;
-    } else if (node == root_dir) {
-      cerr << "rmdir: error: Cannot remove root." << endl;
-    } else if (node == pwd) {
-      cerr << "rmdir: error: Cannot remove working directory." << endl;
-    } else if (node->contents.size() > 0) {
-      cerr << "rmdir: error: Directory not empty." << endl;
-    } else if (node->type != dir) {
-      cerr << "rmdir: error: " << node->name << " must be directory." << endl;
-    } else {
-      parent->contents.remove(node);
-    }
+    int rc = rmdir(args[i]);
+    if (rc < 0) report(args[0], args[i], rc);
   }
 }
 
@@ -409,12 +984,12 @@ void FSImp::rmdir(vector<string> args) {
 void FSImp::printwd(vector<string> args) {
   ops_exactly(0);
 
-  if (pwd == root_dir) {
+  auto wd = get_pwd();
+  if (wd == root_dir) {
       cout << "/" << endl;
       return;
   }
 
-  auto wd = pwd;
   deque<string> plist;
   while (wd != root_dir) {
     plist.push_front(wd->name);
@@ -439,53 +1014,117 @@ void FSImp::cd(vector<string> args) {
   } else if (node->type != dir) {
     cerr << "cd: error: " << args[1] << " must be a directory." << endl;
   } else {
+    lock_guard<mutex> guard(pwd_lock);
     pwd = node;
   }
 }
 
-//get the paths for source and destination. add the new file to the destination
-void FSImp::link(vector<string> args) {
-  ops_exactly(2);
-
-  auto src_path = parse_path(args[1]);
+//links must join different directories
+int FSImp::link(const string &src_str, const string &dest_str) {
+  auto src_path = parse_path(src_str);
   auto src = src_path->final_node;
   auto src_parent = src_path->parent_node;
-  auto dest_path = parse_path(args[2]);
+  auto dest_path = parse_path(dest_str);
   auto dest = dest_path->final_node;
   auto dest_parent = dest_path->parent_node;
   auto dest_name = dest_path->final_name;
 
-  if (src == nullptr) {
-    cerr << "link: error: Cannot find " << args[1] << endl;
+  if (src == nullptr || dest_path->invalid_path) {
+    return -ENOENT;
   } else if (dest != nullptr) {
-    cerr << "link: error: " << args[2] << " already exists." << endl;
+    return -EEXIST;
   } else if (src->type != file) {
-    cerr << "link: error: " << args[1] << " must be a file." << endl;
+    return -EISDIR;
   } else if (src_parent == dest_parent) {
-    cerr << "link: error: src and dest must be in different directories." << endl;
-  } else {
-    auto new_file = DirEntry::make_file(dest_name, dest_parent, src->inode);
-    dest_parent->contents.push_back(new_file);
+    return -EINVAL;
+  } else if (dest_name.size() > SuperBlock::max_name) {
+    return -ENAMETOOLONG;
   }
+  auto new_file = DirEntry::make_file(dest_name, dest_parent, src->inode);
+  Journal::Op op(journal);
+  if (!dest_parent->add_entry(new_file)) {
+    return -EEXIST;
+  }
+  dentry_cache.name_created();
+  return 0;
 }
 
-//
-void FSImp::unlink(vector<string> args) {
-  ops_exactly(1);
+//get the paths for source and destination. add the new file to the destination
+void FSImp::link(vector<string> args) {
+  ops_exactly(2);
 
-  auto path = parse_path(args[1]);
+  int rc = link(args[1], args[2]);
+  if (rc == -EINVAL) {
+    cerr << "link: error: src and dest must be in different directories." << endl;
+  } else if (rc < 0) {
+    report(args[0], rc == -EEXIST ? args[2] : args[1], rc);
+  }
+}
+
+int FSImp::unlink(const string &path_str) {
+  auto path = parse_path(path_str);
   auto node = path->final_node;
   auto parent = path->parent_node;
 
   if (node == nullptr) {
-    cerr << "unlink: error: File not found." << endl;
+    return -ENOENT;
   } else if (node->type != file) {
-    cerr << "unlink: error: " << args[1] << " must be a file." << endl;
+    return -EISDIR;
   } else if (node->is_locked) {
-    cerr << "unlink: error: " << args[1] << " is open." << endl;
-  } else {
-    parent->contents.remove(node);
+    return -EBUSY;
+  }
+  Journal::Op op(journal);
+  parent->remove_child(node->name);
+  dentry_cache.name_removed();
+  return 0;
+}
+
+//remove a name of a file
+void FSImp::unlink(vector<string> args) {
+  ops_exactly(1);
+
+  int rc = unlink(args[1]);
+  if (rc < 0) report(args[0], args[1], rc);
+}
+
+//Helper to fill st from an inode; a directory's blocks change under its DirEntry's
+//lock rather than the inode's, so only its number and links are reported
+void FSImp::inode_stat(Inode &inode, Stat &st) {
+  ReadGuard guard(inode.lock);
+  st = Stat();
+  st.ino = inode.ino;
+  st.is_dir = inode.is_dir;
+  st.links = inode.links;
+  if (!inode.is_dir) {
+    st.size = inode.size;
+    st.blocks = inode.blocks_used;
+    st.shared = store.shared_blocks(inode);
+    st.extents = inode.extents.size();
+    st.breaks = inode.breaks();
+    st.in_inode = inode.packed && inode.packed->tail_block == 0;
+    st.in_tail = inode.packed && inode.packed->tail_block != 0;
+  }
+}
+
+int FSImp::stat(const string &path_str, Stat &st) {
+  auto node = parse_path(path_str)->final_node;
+  if (node == nullptr) {
+    return -ENOENT;
   }
+  inode_stat(*node->inode, st);
+  return 0;
+}
+
+int FSImp::fstat(int fd, Stat &st) {
+  auto desc = fd < 0 ? nullptr : find_descriptor(fd);
+  return desc == nullptr ? -EBADF : fstat(*desc, st);
+}
+
+int FSImp::fstat(Descriptor &desc, Stat &st) {
+  inode_stat(*desc.inode.lock(), st);
+  lock_guard<mutex> desc_guard(desc.lock);
+  st.size = file_size(desc);
+  return 0;
 }
 
 //Print some stats related to input 
@@ -493,22 +1132,29 @@ void FSImp::stat(vector<string> args) {
   ops_at_least(1);
 
   for (uint i = 1; i < args.size(); i++) {
-    auto path = parse_path(args[i]);
-    auto node = path->final_node;
-
-    if (node == nullptr) {
-      cerr << "stat: error: " << args[i] << " not found." << endl;
-    } else {
-      cout << "  File: " << node->name << endl;
-      if (node->type == file) {
-        cout << "  Type: file" << endl;
-        cout << " Inode: " << node->inode.get() << endl;
-        cout << " Links: " << node->inode.use_count() << endl;
-        cout << "  Size: " << node->inode->size << endl;
-        cout << "Blocks: " << node->inode->blocks_used << endl;
-      } else if(node->type == dir) {
-        cout << "  Type: directory" << endl;
+    Stat st;
+    int rc = stat(args[i], st);
+    if (rc < 0) {
+      report(args[0], args[i], rc);
+      continue;
+    }
+    cout << "  File: " << parse_path(args[i])->final_name << endl;
+    if (!st.is_dir) {
+      cout << "  Type: file" << endl;
+      cout << " Inode: " << st.ino << endl;
+      cout << " Links: " << st.links << endl;
+      cout << "  Size: " << st.size << endl;
+      cout << "Blocks: " << st.blocks << endl;
+      cout << "Shared: " << st.shared << endl;
+      if (st.in_inode || st.in_tail) {
+        cout << "Packed: " << (st.in_inode ? "in the inode" : "in a tail block") << endl;
       }
+      //0 when the blocks are one run on disk, 100 when no two of them are adjacent
+      cout << "Extents: " << st.extents << " (" << fixed << setprecision(2)
+           << (st.blocks > 1 ? 100.0 * st.breaks / (st.blocks - 1) : 0.0)
+           << "% fragmented)" << endl;
+    } else {
+      cout << "  Type: directory" << endl;
     }
   }
 }
@@ -516,7 +1162,7 @@ void FSImp::stat(vector<string> args) {
 //print the contents of current directory
 void FSImp::ls(vector<string> args) {
   ops_exactly(0);
-  for (auto dir : pwd->contents) {
+  for (auto dir : get_pwd()->children()) {
     cout << dir->name << endl;
   }
 }
@@ -526,16 +1172,22 @@ void FSImp::cat(vector<string> args) {
   ops_at_least(1);
 
   for(uint i = 1; i < args.size(); i++) {
-    Descriptor desc;
-    if(!basic_open(&desc, vector<string> {args[0], args[i], "r"})) {
-      /* failed to open */
+    shared_ptr<Descriptor> desc;
+    int rc = basic_open(args[i], R, desc);
+    if(rc < 0) {
+      report(args[0], args[i], rc);
       continue;
     }
     
-    auto size = desc.inode.lock()->size;
-    read(vector<string>
-            {args[0], std::to_string(desc.fd), std::to_string(size)});
-    basic_close(desc.fd);
+    {
+      lock_guard<mutex> desc_guard(desc->lock);
+      stream(*desc, file_size(*desc), [](const char *data, uint len) {
+        cout.write(data, len);
+        return true;
+      });
+      cout << endl;
+    }
+    basic_close(desc->fd);
   }
 }
 
@@ -544,26 +1196,45 @@ void FSImp::cat(vector<string> args) {
 void FSImp::copy(vector<string> args) {
   ops_exactly(2);
   
-  Descriptor src, dest;
-  if(basic_open(&src, vector<string> {args[0], args[1], "r"})) {
-    if(!basic_open(&dest, vector<string> {args[0], args[2], "w"})) {
-      basic_close(src.fd);
+  shared_ptr<Descriptor> src, dest;
+  int rc = basic_open(args[1], R, src);
+  if(rc < 0) {
+    report(args[0], args[1], rc);
+  } else {
+    rc = basic_open(args[2], W, dest);
+    if(rc < 0) {
+      report(args[0], args[2], rc);
+      basic_close(src->fd);
     } else {
-      auto data = basic_read(src, src.inode.lock()->size);
-      if (!basic_write(dest, *data)) {
-        cerr << args[0] << ": error: out of free space or file too large"
-             << endl;
+      bool cloned;
+      {
+        //a new copy shares the source's blocks until one of them is written
+        Journal::Op op(journal);
+        cloned = store.share(*src->inode.lock(), *dest->inode.lock());
+      }
+      if (!cloned) {
+        lock_guard<mutex> src_guard(src->lock);
+        lock_guard<mutex> dest_guard(dest->lock);
+        auto size = file_size(*src);
+        bool copied = stream(*src, size, [&](const char *data, uint len) {
+          return len == 0 || basic_write(*dest, data, len) == len;
+        });
+        if (!copied) {
+          cerr << args[0] << ": error: out of free space or file too large"
+               << endl;
+        }
       }
-      basic_close(src.fd);
-      basic_close(dest.fd);
+      basic_close(src->fd);
+      basic_close(dest->fd);
     }
   }
 }
 
 //Helper to print directory structure
 void tree_helper(shared_ptr<DirEntry> directory, string indent) {
-  auto cont = directory->contents;
+  auto cont = directory->children();
   if (directory->type == file) {
+    ReadGuard guard(directory->inode->lock);
     cout << directory->name << ": " << directory->inode->size 
         << " bytes" << endl;
   } else {
@@ -586,5 +1257,193 @@ void tree_helper(shared_ptr<DirEntry> directory, string indent) {
 void FSImp::tree(vector<string> args) {
   ops_exactly(0);
 
-  tree_helper(pwd, "");
+  tree_helper(get_pwd(), "");
+}
+
+//flush every descriptor's buffer, commit the journal, then write the free maps and all
+//dirty cached blocks back to the disk file
+int FSImp::fsync() {
+  vector<shared_ptr<Descriptor> > descs;
+  for (auto &shard : open_files) {
+    lock_guard<mutex> guard(shard.lock);
+    for (auto &kv : shard.files) {
+      descs.push_back(kv.second);
+    }
+  }
+  int rc = 0;
+  for (auto &desc : descs) {
+    lock_guard<mutex> desc_guard(desc->lock);
+    if (!flush_pending(*desc)) {
+      rc = -ENOSPC;
+    }
+  }
+
+  journal.commit();
+  store.flush();
+  block_cache.sync();
+  return rc;
+}
+
+void FSImp::sync(vector<string> args) {
+  ops_exactly(0);
+
+  fsync();
+}
+
+//print block cache occupancy and hit/miss counters
+void FSImp::cache(vector<string> args) {
+  ops_exactly(0);
+
+  auto st = block_cache.stats();
+  unsigned long lookups = st.hits + st.misses;
+  cout << "    Blocks: " << block_cache.size() << "/" << block_cache.max_size() << endl;
+  cout << "     Dirty: " << block_cache.dirty() << endl;
+  cout << "      Hits: " << st.hits << endl;
+  cout << "    Misses: " << st.misses << endl;
+  cout << "  Hit rate: " << fixed << setprecision(2)
+       << (lookups ? 100.0 * st.hits / lookups : 0.0) << "%" << endl;
+  cout << " Evictions: " << st.evictions << endl;
+  cout << "Writebacks: " << st.writebacks << endl;
+  cout << "Device I/O: " << st.device_ios << " for " << st.device_blocks << " blocks" << endl;
+  cout << " I/O saved: " << st.device_blocks - st.device_ios << endl;
+  cout << "Read-ahead: " << st.ahead << " blocks, " << st.ahead_hits << " used ("
+       << (st.ahead ? 100.0 * st.ahead_hits / st.ahead : 0.0) << "%)" << endl;
+  cout << "    Engine: " << engine->name() << ", " << engine->stats.batches << " batches of "
+       << engine->stats.requests << " requests, up to " << engine->stats.max_in_flight << " in flight" << endl;
+
+  unsigned long dlookups = dentry_cache.hits + dentry_cache.misses;
+  cout << "Path cache: " << dentry_cache.size() << "/" << dentry_cache_size << endl;
+  cout << " Path hits: " << dentry_cache.hits << " ("
+       << (dlookups ? 100.0 * dentry_cache.hits / dlookups : 0.0) << "%)" << endl;
+}
+
+//print how the free space is split up and how much of the host the sparse image takes
+void FSImp::frag(vector<string> args) {
+  ops_exactly(0);
+
+  auto st = allocator.stats();
+  cout << "  Free blocks: " << st.free_blocks << "/" << num_blocks << endl;
+  cout << "    Free runs: " << st.free_runs << endl;
+  cout << "  Largest run: " << st.largest_run << endl;
+  cout << "Fragmentation: " << fixed << setprecision(2)
+       << 100.0 * allocator.fragmentation() << "%" << endl;
+  cout << "   Host space: " << device->allocated() / 1024 << "/"
+       << static_cast<off_t>(num_blocks) * block_size / 1024 << " KiB" << endl;
+}
+
+//print journal counters, or set the commit interval (ms) and batch size
+void FSImp::journaling(vector<string> args) {
+  if (args.size() != 1 && args.size() != 3) {
+    cout << args[0] << " : expects no operands or an interval and a batch size" << endl;
+    return;
+  }
+  if (!journal.enabled()) {
+    cout << "   Journal: off" << endl;
+    return;
+  }
+
+  if (args.size() == 3) {
+    uint interval_ms, batch;
+    if (!(istringstream(args[1]) >> interval_ms) || !(istringstream(args[2]) >> batch) || batch == 0) {
+      cerr << "journal: error: Invalid interval or batch size." << endl;
+      return;
+    }
+    journal.tune(interval_ms, batch);
+  }
+
+  auto config = journal.settings();
+  auto st = journal.stats();
+  cout << "   Journal: " << journal.size() << " blocks, commit every " << config.interval_ms
+       << " ms or " << config.batch << " ops" << endl;
+  cout << "   Commits: " << st.commits << " for " << st.ops << " ops ("
+       << fixed << setprecision(2) << (st.commits ? static_cast<double>(st.ops) / st.commits : 0.0)
+       << " per commit)" << endl;
+  cout << "    Logged: " << st.blocks << " blocks" << endl;
+  cout << "     Syncs: " << st.syncs << " for " << st.waits << " waits" << endl;
+  cout << "Checkpoint: " << st.checkpoints << endl;
+  cout << " Overflows: " << st.overflows << endl;
+}
+
+//print write buffer counters, or set how many bytes each descriptor holds back (0 for none)
+void FSImp::buffering(vector<string> args) {
+  ops_less_than(1);
+
+  if (args.size() == 2) {
+    uint bytes;
+    if (!(istringstream(args[1]) >> bytes)) {
+      cerr << args[0] << ": error: Invalid buffer size." << endl;
+      return;
+    }
+    set_write_buffer(bytes);
+  }
+
+  cout << "  Buffer: " << write_buffer << " bytes per descriptor" << endl;
+  cout << "    Held: " << buffered_bytes << " bytes" << endl;
+  cout << "  Writes: " << buffered_writes << " buffered" << endl;
+  cout << " Flushes: " << buffer_flushes << endl;
+}
+
+//print read-ahead counters, or set the largest window in blocks (0 turns it off)
+void FSImp::prefetching(vector<string> args) {
+  ops_less_than(1);
+
+  if (args.size() == 2) {
+    uint blocks;
+    if (!(istringstream(args[1]) >> blocks)) {
+      cerr << args[0] << ": error: Invalid window size." << endl;
+      return;
+    }
+    set_read_ahead(blocks);
+  }
+
+  auto st = block_cache.stats();
+  cout << "  Window: up to " << read_ahead.get_max_window() << " blocks" << endl;
+  cout << "   Reads: " << read_ahead.stats.reads << " (" << read_ahead.stats.sequential
+       << " sequential)" << endl;
+  cout << " Windows: " << read_ahead.stats.windows << " (" << read_ahead.stats.dropped
+       << " dropped, " << read_ahead.stats.late << " late)" << endl;
+  cout << " Fetched: " << st.ahead << " blocks" << endl;
+  cout << "    Used: " << st.ahead_hits << " (" << fixed << setprecision(2)
+       << (st.ahead ? 100.0 * st.ahead_hits / st.ahead : 0.0) << "%)" << endl;
+}
+
+//one line of the memory report: slots in use and what the slab holds
+static void slab_line(const char *what, const Slab::Stats &st) {
+  cout << setw(10) << what << ": " << st.used << " x " << st.slot_size << " bytes, "
+       << st.slots * st.slot_size / 1024 << " KiB reserved";
+  if (st.large) cout << ", " << st.large << " too large for a slot";
+  cout << endl;
+}
+
+//print what names, directories and inodes in memory cost; the slabs are shared by
+//every file system in the process
+void FSImp::memory(vector<string> args) {
+  ops_exactly(0);
+
+  auto entries = DirEntry::entry_slab.stats();
+  auto links = DirEntry::link_slab.stats();
+  auto dirs = DirEntry::dir_slab.stats();
+  auto inodes = Inode::slab.stats();
+  slab_line("Names", entries);
+  slab_line("Links", links);
+  slab_line("Dirs", dirs);
+  slab_line("Inodes", inodes);
+
+  unsigned long used = entries.used * entries.slot_size + links.used * links.slot_size +
+                       dirs.used * dirs.slot_size + inodes.used * inodes.slot_size;
+  cout << "  Per name: " << (entries.used ? used / entries.used : 0) << " bytes" << endl;
+}
+
+//print how many small files are packed and what that saves
+void FSImp::packing(vector<string> args) {
+  ops_exactly(0);
+
+  auto st = store.pack_stats();
+  unsigned long saved = st.blocks > st.tail_blocks ? st.blocks - st.tail_blocks : 0;
+  cout << " Inline files: " << st.inline_files << endl;
+  cout << "   Tail files: " << st.tail_files << " in " << st.tail_blocks << " tail blocks" << endl;
+  cout << " Packed bytes: " << st.bytes << endl;
+  cout << "  Space saved: " << saved << " blocks (" << saved * block_size / 1024 << " KiB)" << endl;
+  cout << "    I/O saved: " << packed_reads << " reads and " << packed_writes
+       << " writes without a data block" << endl;
 }
@@ -11,76 +11,260 @@ The file system contains the following information:
 		- a pointer to the parent node
 		- a pointer to the final node 
 	3. file/dir name
-	4. block size, disk file, number of direct blocks, number of blocks making up the file/dir
-	5. freeNode list
-	6. root directory path, current working dir path
-	7. a list of open files along with the corresponding descriptors.
-	8. basic commands like open, close, write, seek, read, mkdir, rmdir, cd, link, unlink, stat, ls, cat, 
-       cp, print working directory, tree representation
+	4. block size, disk image device, number of blocks making up the file/dir; for
+	   power-of-two block sizes from 512 B to 64 KiB the read and write loops are
+	   instances mapping offsets with shifts and masks, for others with divisions
+	5. free space allocator
+	6. root directory path, current working dir path, and a cache of resolved paths
+	7. a table of open files along with the corresponding descriptors.
+	8. a write-back block cache that all file data goes through on its way to the disk file
+	9. the on-disk layout (superblock, inode table, directory blocks, free maps);
+	   an existing image is mounted as it is and its directories load on first use;
+	   the image is a sparse file and freed data blocks are punched out of it;
+	   metadata changes go through a journal that commits them in groups;
+	   cp shares the source's blocks and a write gives shared blocks copies of their own
+	   a file's blocks are allocated where its last run ends, a new file's near its
+	   parent directory's, so appends stay contiguous; small writes are buffered per
+	   descriptor and allocated as one run when the buffer is flushed; small files are
+	   packed into their inode or a tail block shared with other small files
+	10. an I/O engine (io_uring or a thread pool) that large reads and writes use to move
+	   a window of blocks at a time with many device requests in flight; descriptors
+	   read sequentially have a growing window of the blocks ahead loaded in the background
+	11. basic commands like open, close, write, seek, read, mkdir, rmdir, cd, link, unlink, stat, ls, cat, 
+       cp, fallocate, print working directory, tree representation, sync, cache statistics,
+       free space fragmentation, journal statistics and tuning, write buffer statistics and tuning,
+       read-ahead statistics and tuning, memory use of the names and inodes in memory,
+       small file packing statistics
+Programs embedding the file system use the typed interface (open, read, write, lseek,
+stat, ...), whose calls return negative errno values instead of printing; the string
+commands the REPL runs are a thin shell over it that parses arguments and prints results.
+A compound runs a list of typed calls in one go, later ones using the descriptor an
+earlier open returned, as one transaction with one allocation pass per file and one commit.
+All public methods may be called from several threads at once: directories, inodes,
+descriptors, the open file table, the allocator and the block cache each have their
+own locks, and the disk image is accessed with positional I/O (the fstream backend
+serializes its accesses instead).
 */
 
 #ifndef _FSIMP_H_
 #define _FSIMP_H_
 
+#include "allocator.hpp"
+#include "blockCache.hpp"
+#include "blockDevice.hpp"
+#include "dentryCache.hpp"
 #include "dirEntry.hpp"
-#include "freeNode.hpp"
+#include "geometry.hpp"
 #include "inode.hpp"
+#include "ioEngine.hpp"
+#include "journal.hpp"
+#include "readAhead.hpp"
+#include "superBlock.hpp"
 
-#include <fstream>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <functional>
 #include <list>
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 class FSImp{
-    
+  public:
     enum Mode {R, W, RW};
+
+    //what stat reports about a file or directory
+    struct Stat{
+        uint ino;
+        bool is_dir;
+        uint links;
+        uint size;          //logical size in bytes
+        uint blocks;        //allocated blocks
+        uint shared;        //blocks shared with a copy
+        uint extents;
+        uint breaks;        //extents that do not continue the one before on disk
+        bool in_inode;      //a small file packed into its inode record
+        bool in_tail;       //a small file packed into a tail block shared with others
+    };
+
+    //One step of a compound: the typed call named by type, with the fields it uses set.
+    //fd may be current, the descriptor the last open of the same compound returned.
+    struct CompoundOp{
+        enum Type {open_op, write_op, read_op, seek_op, fallocate_op, close_op, stat_op, mkdir_op, unlink_op};
+        static const int current = -2;
+
+        Type type;
+        std::string path;           //open, mkdir, unlink, stat; stat with no path stats fd
+        Mode mode = R;              //open
+        int fd = current;           //write, read, seek, fallocate, close, stat with no path
+        const void *data = nullptr; //write
+        void *buf = nullptr;        //read
+        size_t count = 0;           //write and read; the length for fallocate
+        off_t offset = 0;           //seek and fallocate
+        int whence = SEEK_SET;      //seek
+        Stat *st = nullptr;         //stat
+
+        static CompoundOp open(const std::string &path, Mode mode) { CompoundOp op(open_op); op.path = path; op.mode = mode; return op; }
+        static CompoundOp write(const void *data, size_t count, int fd = current) { CompoundOp op(write_op, fd); op.data = data; op.count = count; return op; }
+        static CompoundOp read(void *buf, size_t count, int fd = current) { CompoundOp op(read_op, fd); op.buf = buf; op.count = count; return op; }
+        static CompoundOp seek(off_t offset, int whence, int fd = current) { CompoundOp op(seek_op, fd); op.offset = offset; op.whence = whence; return op; }
+        static CompoundOp fallocate(off_t offset, off_t length, int fd = current) { CompoundOp op(fallocate_op, fd); op.offset = offset; op.count = length; return op; }
+        static CompoundOp close(int fd = current) { return CompoundOp(close_op, fd); }
+        static CompoundOp stat(const std::string &path, Stat &st) { CompoundOp op(stat_op); op.path = path; op.st = &st; return op; }
+        static CompoundOp fstat(Stat &st, int fd = current) { CompoundOp op(stat_op, fd); op.st = &st; return op; }
+        static CompoundOp mkdir(const std::string &path) { CompoundOp op(mkdir_op); op.path = path; return op; }
+        static CompoundOp unlink(const std::string &path) { CompoundOp op(unlink_op); op.path = path; return op; }
+
+      private:
+        explicit CompoundOp(Type type, int fd = current) : type(type), fd(fd) {}
+    };
+
+  private:
     struct Descriptor{
         Mode mode;      //access rights for the file/dir
         uint byte_pos;  
         std::weak_ptr<Inode> inode;     //pointer to inode of file/dir
         std::weak_ptr<DirEntry> from;   //pointer to the file/dir
         uint fd;        //number of last file descriptor
+        std::mutex lock;                //held while the descriptor is in use so byte_pos moves atomically
+        //written bytes not given to the file yet, for [pending_pos, pending_pos + pending.size())
+        std::vector<char> pending;
+        uint pending_pos = 0;
+        ReadAhead::Stream ahead;
+    };
+    //the open file table is split by fd into shards, each with its own lock
+    struct FdShard{
+        std::mutex lock;
+        std::map<uint, std::shared_ptr<Descriptor> > files;
     };
     bool getMode(Mode *mode, std::string mode_s);
 
-    struct PathRet{
-        bool invalid_path = false;
-        std::string final_name;
-        std::shared_ptr<DirEntry> parent_node;
-        std::shared_ptr<DirEntry> final_node;
-    };
+    typedef DentryCache::Resolution PathRet;
 
     const std::string filename;
-    std::fstream disk_file;
     const uint block_size;
-    const uint direct_blocks;
     const uint num_blocks;
+    std::unique_ptr<BlockDevice> device;
+    static const uint engine_depth = 64;
+    std::unique_ptr<IoEngine> engine;
+    static const uint cache_shards = 8;
+    BlockCache block_cache;
+    //reads and writes of at least batch_threshold blocks go through the engine batch_window blocks at a time
+    static const uint batch_threshold = 8;
+    const uint batch_window;
+    //cat and cp move a file through two buffers of stream_chunk bytes, reading one while the other is written
+    static const uint stream_chunk = 256 * 1024;
+    //Sequential readers get up to batch_window / 2 blocks ahead of them loaded in the
+    //background. A window is used up to three of its own sizes after it is loaded, which
+    //has to fit in a cache shard or read-ahead evicts its own blocks.
+    ReadAhead read_ahead;
+    Journal journal;
 
     //DirEntry root
-    std::list<FreeNode> freeNode_list;
+    static const uint allocator_shards = 8;
+    Allocator allocator;
+    SuperBlock store;
     std::shared_ptr<DirEntry> root_dir;
     std::shared_ptr<DirEntry> pwd;
-    std::map<uint, Descriptor> open_files;
-    uint next_descriptor = 0;
+    mutable std::mutex pwd_lock;
+    static const uint dentry_cache_size = 4096;
+    mutable DentryCache dentry_cache;
+    static const uint fd_shards = 16;
+    FdShard open_files[fd_shards];
+    std::atomic<uint> next_descriptor;
+    //Writes are gathered per descriptor up to write_buffer bytes and only reach the file
+    //(and get blocks) when the buffer is flushed: when full, before a read or a write
+    //elsewhere in the file, on close and on fsync. All buffers together stay under buffer_budget.
+    static const unsigned long buffer_budget = 64UL << 20;
+    static const uint default_write_buffer = 64 * 1024;
+    std::atomic<uint> write_buffer;
+    std::atomic<unsigned long> buffered_bytes;
+    std::atomic<unsigned long> buffered_writes;
+    std::atomic<unsigned long> buffer_flushes;
+    //reads and writes of packed files, which touch no data block
+    std::atomic<unsigned long> packed_reads;
+    std::atomic<unsigned long> packed_writes;
 
-    void init_disk(const std::string &file_name);
-    std::unique_ptr<PathRet> parse_path(std::string path_str) const;
-    bool basic_open(Descriptor *d, std::vector< std::string > args);
-    std::unique_ptr<std::string> basic_read(Descriptor &desc, const uint size);
-    uint basic_write(Descriptor &desc, const std::string data);
-    bool basic_close(uint fd);
+    std::shared_ptr<DirEntry> get_pwd() const;
+    std::unique_ptr<PathRet> parse_path(const std::string &path_str) const;
+    std::shared_ptr<Descriptor> find_descriptor(uint fd);
+    uint file_size(Descriptor &desc);
+    int basic_open(const std::string &path, Mode mode, std::shared_ptr<Descriptor> &desc);
+    uint basic_read(Descriptor &desc, char *data, const uint size);
+    uint basic_readv(Descriptor &desc, const struct iovec *iov, int iovcnt);
+    uint basic_write(Descriptor &desc, const char *data, const uint size);
+    uint basic_writev(Descriptor &desc, const struct iovec *iov, int iovcnt);
+    //the read and write loops with offsets mapped by a G, and the instances of them
+    //for block_size, picked once when the FSImp is made
+    template <typename G> uint readv_with(Descriptor &desc, const struct iovec *iov, int iovcnt);
+    template <typename G> uint writev_with(Descriptor &desc, const struct iovec *iov, int iovcnt);
+    uint (FSImp::*mapped_readv)(Descriptor &desc, const struct iovec *iov, int iovcnt);
+    uint (FSImp::*mapped_writev)(Descriptor &desc, const struct iovec *iov, int iovcnt);
+    template <typename G> void use_geometry();
+    void pick_geometry();
+    bool basic_fallocate(Descriptor &desc, uint offset, uint length);
+    void inode_stat(Inode &inode, Stat &st);
+    int basic_close(uint fd, std::vector<std::shared_ptr<Descriptor> > *deferred = nullptr);
+    bool flush_pending(Descriptor &desc);
+    uint buffered_write(Descriptor &desc, const char *data, uint size, uint limit);
+    void settle(const std::vector<std::shared_ptr<Descriptor> > &closed);
+    //the typed calls on a descriptor already found
+    ssize_t read(Descriptor &desc, void *buf, size_t count);
+    ssize_t write(Descriptor &desc, const void *buf, size_t count, uint limit);
+    off_t lseek(Descriptor &desc, off_t offset, int whence);
+    int fallocate(Descriptor &desc, off_t offset, off_t length);
+    int fstat(Descriptor &desc, Stat &st);
+    bool stream(Descriptor &src, uint size, const std::function<bool(const char *, uint)> &sink);
 
   public:
     FSImp(const std::string &filename,
           const uint fs_size,
           const uint block_size,
-          const uint direct_blocks);
+          const uint cache_blocks,
+          const BlockDevice::Type device_type,
+          const IoEngine::Type engine_type = IoEngine::auto_engine,
+          const Journal::Config &journal_config = Journal::Config());
     ~FSImp();
+
+    //Typed interface. Each call returns 0 (or a descriptor, a byte count or an offset)
+    //on success and a negative errno value on failure: -ENOENT, -EEXIST, -EBADF,
+    //-EBUSY (open elsewhere, root or working directory), -EISDIR, -ENOTDIR, -ENOTEMPTY,
+    //-ENAMETOOLONG, -ENOSPC, -EFBIG, -EINVAL.
+    int open(const std::string &path, Mode mode);
+    int close(int fd);
+    //reads stop at the end of the file
+    ssize_t read(int fd, void *buf, size_t count);
+    ssize_t write(int fd, const void *buf, size_t count);
+    //whence is SEEK_SET, SEEK_CUR or SEEK_END; the new position may lie past the end
+    off_t lseek(int fd, off_t offset, int whence);
+    int fallocate(int fd, off_t offset, off_t length);
+    int stat(const std::string &path, Stat &st);
+    int fstat(int fd, Stat &st);
+    int mkdir(const std::string &path);
+    int rmdir(const std::string &path);
+    int link(const std::string &src, const std::string &dest);
+    int unlink(const std::string &path);
+    int fsync();
+    //Run ops in order as one journal transaction, in the manner of an NFSv4 COMPOUND,
+    //stopping at the first that fails. results gets what each op that ran returned, as
+    //its typed call would; the return value is 0, or the failed op's result, and then the
+    //files the compound opened are closed. Files it closes are made durable together at the end.
+    int compound(const std::vector<CompoundOp> &ops, std::vector<ssize_t> &results);
+    //bytes of writes each descriptor may hold back; 0 writes straight through
+    void set_write_buffer(uint bytes) { write_buffer = bytes; }
+    //largest read-ahead window in blocks; 0 turns reading ahead off
+    void set_read_ahead(uint blocks) { read_ahead.set_max_window(blocks); }
+
+    //REPL commands: args[0] is the command name, results and errors are printed
     void open(std::vector<std::string> args);
     void read(std::vector<std::string> args);
     void write(std::vector<std::string> args);
     void seek(std::vector<std::string> args);
+    void fallocate(std::vector<std::string> args);
     void close(std::vector<std::string> args);
     void mkdir(std::vector<std::string> args);
     void rmdir(std::vector<std::string> args);
@@ -93,6 +277,14 @@ class FSImp{
     void copy(std::vector<std::string> args);
     void tree(std::vector<std::string> args);
     void printwd(std::vector<std::string> args);
+    void sync(std::vector<std::string> args);
+    void cache(std::vector<std::string> args);
+    void frag(std::vector<std::string> args);
+    void journaling(std::vector<std::string> args);
+    void buffering(std::vector<std::string> args);
+    void prefetching(std::vector<std::string> args);
+    void memory(std::vector<std::string> args);
+    void packing(std::vector<std::string> args);
 };
 
 #endif
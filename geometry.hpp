@@ -0,0 +1,61 @@
+/*
+A Geometry turns byte positions in a file into block numbers and offsets in a block,
+and block numbers back into bytes. It comes in two kinds
+1. Geometry<BlockSize>: a power-of-two block size fixed at compile time, 512 B to 64 KiB;
+   every mapping is a shift or a mask
+2. Geometry<0>: a block size known only at run time; mappings divide, so any size works
+The read and write loops and the block map are written once against either kind, and
+FSImp picks the compile-time one for its block size when there is one.
+*/
+
+#ifndef _GEOMETRY_H_
+#define _GEOMETRY_H_
+
+#include <sys/types.h>
+
+constexpr uint log2_of(uint n){
+    return n <= 1 ? 0 : 1 + log2_of(n / 2);
+}
+
+template <uint BlockSize>
+class Geometry{
+    static_assert(BlockSize >= 512 && BlockSize <= 65536 && (BlockSize & (BlockSize - 1)) == 0,
+                  "compile-time block sizes are powers of two from 512 B to 64 KiB");
+
+    public:
+        static constexpr uint shift = log2_of(BlockSize);
+        static constexpr uint mask = BlockSize - 1;
+
+        //block_size is BlockSize; taken so both kinds are made the same way
+        explicit Geometry(uint) {}
+
+        uint size() const { return BlockSize; }
+        //block holding byte pos, and where in it pos falls
+        uint block(uint pos) const { return pos >> shift; }
+        uint offset(uint pos) const { return pos & mask; }
+        //blocks needed to cover bytes [0, end)
+        uint blocks(unsigned long end) const { return (end + mask) >> shift; }
+        //bytes in count blocks
+        unsigned long bytes(uint count) const { return static_cast<unsigned long>(count) << shift; }
+        //image position of byte pos of a file when its block is in physical block block
+        off_t image(uint block, uint pos) const { return (static_cast<off_t>(block) << shift) + (pos & mask); }
+};
+
+template <>
+class Geometry<0>{
+    public:
+        const uint block_size;
+
+        explicit Geometry(uint block_size) : block_size(block_size) {}
+
+        uint size() const { return block_size; }
+        uint block(uint pos) const { return pos / block_size; }
+        uint offset(uint pos) const { return pos % block_size; }
+        uint blocks(unsigned long end) const { return (end + block_size - 1) / block_size; }
+        unsigned long bytes(uint count) const { return static_cast<unsigned long>(count) * block_size; }
+        off_t image(uint block, uint pos) const { return static_cast<off_t>(block) * block_size + pos % block_size; }
+};
+
+typedef Geometry<0> RuntimeGeometry;
+
+#endif
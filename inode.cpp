@@ -1,57 +1,136 @@
 #include "inode.hpp"
+#include "superBlock.hpp"
 
 #include <algorithm>
-#include <vector>
-#include <list>
+#include <climits>
+#include <iterator>
 
-using std::list;
+using std::next;
+using std::pair;
+using std::prev;
 using std::shared_ptr;
-using std::sort;
 using std::vector;
 
 uint Inode::block_size = 0;
-list<FreeNode> *Inode::freeNode_list = nullptr;
+SuperBlock *Inode::store = nullptr;
+Slab Inode::slab;
 
-Inode::Inode()
-    :size(0), blocks_used(0), inode_blocks(new vector<vector<uint> >()){}
+Inode::Inode(uint ino, bool is_dir)
+    :ino(ino), is_dir(is_dir), links(0), size(0), blocks_used(0), goal(0){}
 
-~Inode::Inode(){
-    if(blocks_used == 0)
-        return;
-    else if(blocks_used == 1)
-        freeNode_list->emplace_front(block_size, data_blocks[0]);
+shared_ptr<Inode> Inode::create(uint ino, bool is_dir){
+    return std::allocate_shared<Inode>(SlabAllocator<Inode>(slab), ino, is_dir);
+}
 
-    vector<uint> blocks;
+//the blocks only go back to the allocator if no directory links the inode any more
+//and no other inode shares them
+Inode::~Inode(){
+    if(store) store->release_inode(*this);
+}
 
-    for(auto block : data_blocks){
-        blocks.push_back(block);
+//the extent covering lblock, or extents.end() if lblock falls in a hole
+std::map<uint, Inode::Extent>::const_iterator Inode::find(uint lblock) const{
+    auto it = extents.upper_bound(lblock);
+    if(it == extents.begin()) return extents.end();
+    it = prev(it);
+    return lblock < it->second.logical + it->second.length ? it : extents.end();
+}
+
+uint Inode::map_block(uint lblock, uint *contiguous) const{
+    auto it = find(lblock);
+    if(it == extents.end()){
+        auto after = extents.upper_bound(lblock);
+        if(contiguous) *contiguous = after == extents.end() ? UINT_MAX - lblock : after->first - lblock;
+        return hole;
     }
+    const Extent &ext = it->second;
+    uint offset = lblock - ext.logical;
+    if(contiguous) *contiguous = ext.length - offset;
+    return ext.physical + offset;
+}
 
-    for(auto vec : *inode_blocks){
-        for(uint block : vec){
-            blocks.push_back(block);
-        }
+uint Inode::end_block() const{
+    if(extents.empty()) return 0;
+    const Extent &last = extents.rbegin()->second;
+    return last.logical + last.length;
+}
+
+void Inode::image_ranges(uint pos, uint len, vector<pair<off_t, size_t> > &ranges) const{
+    image_ranges(RuntimeGeometry(block_size), pos, len, ranges);
+}
+
+uint Inode::goal_for(uint lblock) const{
+    auto after = extents.upper_bound(lblock);
+    if(after != extents.begin()){
+        const Extent &before = prev(after)->second;
+        return before.physical + (lblock - before.logical);
     }
+    return after == extents.end() ? goal : after->second.physical;
+}
 
-    sort(blocks.begin(), blocks.end());
+uint Inode::breaks() const{
+    uint count = 0;
+    const Extent *last = nullptr;
+    for(auto &kv : extents){
+        if(last && last->physical + last->length != kv.second.physical) count++;
+        last = &kv.second;
+    }
+    return count;
+}
 
-    uint start = blocks.front();
-    uint last = start;
-    uint size = block_size;
+void Inode::append(uint physical, uint length){
+    uint end = end_block();
+    if(!extents.empty()){
+        Extent &last = extents.rbegin()->second;
+        if(last.physical + last.length == physical){
+            //the run continues the last extent on disk
+            last.length += length;
+            blocks_used += length;
+            return;
+        }
+    }
+    extents[end] = Extent{end, physical, length};
+    blocks_used += length;
+}
 
-    blocks.erase(blocks.begin());
+//make lblock the first block of an extent, if an extent covers it
+void Inode::split(uint lblock){
+    auto found = find(lblock);
+    if(found == extents.end()) return;
+    auto it = extents.find(found->first);
+    Extent &ext = it->second;
+    if(ext.logical == lblock) return;
+    uint head = lblock - ext.logical;
+    extents[lblock] = Extent{lblock, ext.physical + head, ext.length - head};
+    ext.length = head;
+}
 
-    for(uint block : blocks){
-        if(block - last != block_size){
-            freeNode_list->emplace_back(size, start);
-            start = block;
-            last = start;
-            size = 0;
-        } else{
-            last = block;
-            size += block_size;
+//join the extent at it with its neighbours where they continue each other on disk
+void Inode::merge(std::map<uint, Extent>::iterator it){
+    if(it != extents.begin()){
+        auto before = prev(it);
+        if(before->second.logical + before->second.length == it->second.logical
+           && before->second.physical + before->second.length == it->second.physical){
+            before->second.length += it->second.length;
+            extents.erase(it);
+            it = before;
         }
     }
+    auto after = next(it);
+    if(after != extents.end() && after->second.logical == it->second.logical + it->second.length
+       && after->second.physical == it->second.physical + it->second.length){
+        it->second.length += after->second.length;
+        extents.erase(after);
+    }
+}
 
-    freeNode_list->emplace_front(size, start);
+void Inode::remap(uint lblock, uint length, uint physical){
+    split(lblock);
+    split(lblock + length);
+    auto first = extents.lower_bound(lblock);
+    auto last = extents.lower_bound(lblock + length);
+    for(auto it = first; it != last; ++it) blocks_used -= it->second.length;
+    extents.erase(first, last);
+    blocks_used += length;
+    merge(extents.emplace(lblock, Extent{lblock, physical, length}).first);
 }
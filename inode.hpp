@@ -1,32 +1,119 @@
 /*
 Every Inode object contains
-1. a list of pointers to freeNodes
+1. a pointer to the SuperBlock that reads and writes its record in the inode table
 2. block size
-3. blocks used
-4. A list of pointers to inode blocks that are owned by a unique pointer.
+3. its inode number, whether it is a directory, how many directory entries link
+   it, file size and the number of blocks allocated to it
+4. the block map: extents of (logical block, physical block, length) keyed by
+   their first logical block, so a file offset is mapped in O(log n); logical
+   blocks no extent covers are holes, which read as zeroes and take no space
+5. a reader/writer lock: reads of the file share it, writes and resizes hold it exclusively
+6. the extent blocks its extents overflow into on disk
+7. an allocation goal for a file with no blocks yet: its parent directory's data
+8. a slab that every Inode in memory is allocated from, together with its reference counts
+9. for a small file, its packed bytes: kept in the inode record or in a fragment of a tail
+   block shared with other small files instead of blocks of its own, and in memory while
+   the Inode is, so reading it takes no block I/O
+An Inode in memory is only a copy of its record: dropping it frees nothing unless
+its link count has reached zero, and then only the blocks no other inode shares.
 */
 #ifndef _INODE_H_
 #define _INODE_H_
 
-#include "freeNode.hpp"
+#include "allocator.hpp"
+#include "geometry.hpp"
+#include "rwLock.hpp"
+#include "slab.hpp"
 
 #include <sys/types.h>
-#include <list>
-#include <vector>
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
+
+class SuperBlock;
 
 class Inode{
     public:
+        struct Extent{
+            uint logical;
+            uint physical;
+            uint length;
+        };
+
+        //map_block's answer for a logical block in a hole; block 0 holds the superblock
+        static const uint hole = 0;
+
+        //the bytes of a packed file, which has no extents
+        struct Packed{
+            std::vector<char> data;     //the whole file, size bytes
+            uint tail_block = 0;        //tail block holding them, 0 if they are in the record
+            uint tail_unit = 0;         //first unit of their fragment there
+            uint tail_units = 0;        //units the fragment takes
+        };
+
         static uint block_size;
-        static std::list<FreeNode> *freeNode_list;
+        static SuperBlock *store;
+        static Slab slab;
+        const uint ino;
+        const bool is_dir;
+        uint links;
         uint size;
-        uint blocks_used; 
-        std::vector<uint> data_blocks;
-        std::unique_ptr<std::vector<std::vector<uint> > > inode_blocks;
+        uint blocks_used;   //allocated blocks, fewer than size covers if the file has holes
+        uint goal;          //where the first blocks should go, 0 if anywhere; kept in memory only
+        std::map<uint, Extent> extents;
+        std::vector<uint> extent_blocks;
+        std::unique_ptr<Packed> packed;     //nullptr unless the file is packed
+        RWLock lock;
         
-        Inode();
+        Inode(uint ino, bool is_dir);
         ~Inode();
+        //a new Inode in one slot of the slab
+        static std::shared_ptr<Inode> create(uint ino, bool is_dir);
+
+        //Physical block backing logical block lblock, and how many blocks from there on
+        //are physically contiguous within the same extent. In a hole it is hole, and
+        //contiguous counts the blocks up to the next extent.
+        uint map_block(uint lblock, uint *contiguous = nullptr) const;
+        //the logical block after the last extent
+        uint end_block() const;
+        //the pieces of the image holding bytes [pos, pos + len) of the file, as (byte
+        //position, length) pairs, one per contiguous run of blocks; holes have none
+        void image_ranges(uint pos, uint len, std::vector<std::pair<off_t, size_t> > &ranges) const;
+        //the same, mapping offsets with geo
+        template <typename G>
+        void image_ranges(const G &geo, uint pos, uint len, std::vector<std::pair<off_t, size_t> > &ranges) const;
+        //the physical block logical block lblock would have if the nearest extent before
+        //it carried on, else the first block of the nearest one after it, else goal
+        uint goal_for(uint lblock) const;
+        //extents that do not start where the one before them ends on disk
+        uint breaks() const;
+        //add physical blocks [physical, physical + length) after the last extent
+        void append(uint physical, uint length);
+        //back logical blocks [lblock, lblock + length), holes or not, with physical blocks from physical on
+        void remap(uint lblock, uint length, uint physical);
+
+    private:
+        std::map<uint, Extent>::const_iterator find(uint lblock) const;
+        void split(uint lblock);
+        void merge(std::map<uint, Extent>::iterator it);
 };
 
+template <typename G>
+void Inode::image_ranges(const G &geo, uint pos, uint len, std::vector<std::pair<off_t, size_t> > &ranges) const{
+    ranges.clear();
+    while(len > 0){
+        uint contiguous;
+        uint block = map_block(geo.block(pos), &contiguous);
+        unsigned long run = geo.bytes(contiguous) - geo.offset(pos);
+        uint piece = run < len ? run : len;
+        if(block != hole){
+            ranges.emplace_back(geo.image(block, pos), piece);
+        }
+        pos += piece;
+        len -= piece;
+    }
+}
+
 #endif
@@ -0,0 +1,246 @@
+#include "ioEngine.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::runtime_error;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+unique_ptr<IoEngine> IoEngine::create(Type type, BlockDevice &device, const uint depth){
+#ifdef FS_HAVE_IO_URING
+    if(type != pool_engine && device.fd() >= 0){
+        try{
+            return unique_ptr<IoEngine>(new UringEngine(device, depth));
+        } catch(runtime_error &){
+            //no io_uring in this kernel or sandbox
+        }
+    }
+#endif
+    uint threads = min(depth, max(2U, 2 * std::thread::hardware_concurrency()));
+    return unique_ptr<IoEngine>(new PoolEngine(device, max(threads, 1U)));
+}
+
+void IoEngine::note_in_flight(unsigned long n){
+    unsigned long seen = stats.max_in_flight;
+    while(n > seen && !stats.max_in_flight.compare_exchange_weak(seen, n)){}
+}
+
+//issue a request synchronously on the device
+static void issue(BlockDevice &device, const IoEngine::Request &req){
+    if(req.write){
+        device.writev(req.pos, req.iov, req.iovcnt);
+    } else{
+        device.readv(req.pos, req.iov, req.iovcnt);
+    }
+}
+
+PoolEngine::PoolEngine(BlockDevice &device, const uint threads)
+    :device(device), in_flight(0), stopping(false){
+    for(uint i = 0; i < threads; i++){
+        workers.emplace_back(&PoolEngine::worker, this);
+    }
+}
+
+PoolEngine::~PoolEngine(){
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    work.notify_all();
+    for(auto &t : workers){
+        t.join();
+    }
+}
+
+void PoolEngine::worker(){
+    while(true){
+        Task task;
+        {
+            unique_lock<mutex> guard(lock);
+            work.wait(guard, [this] { return stopping || !queue.empty(); });
+            if(queue.empty()) return;
+            task = queue.front();
+            queue.pop_front();
+        }
+
+        std::exception_ptr error;
+        try{
+            issue(device, task.req);
+        } catch(...){
+            error = std::current_exception();
+        }
+        in_flight--;
+
+        lock_guard<mutex> guard(task.batch->lock);
+        if(error) task.batch->error = error;
+        if(--task.batch->remaining == 0) task.batch->done.notify_all();
+    }
+}
+
+void PoolEngine::run(const vector<Request> &batch){
+    if(batch.empty()) return;
+    stats.batches++;
+    stats.requests += batch.size();
+
+    Batch b;
+    b.remaining = batch.size();
+    {
+        lock_guard<mutex> guard(lock);
+        for(auto &req : batch){
+            queue.push_back(Task{req, &b});
+        }
+        note_in_flight(in_flight += batch.size());
+    }
+    work.notify_all();
+
+    unique_lock<mutex> guard(b.lock);
+    b.done.wait(guard, [&b] { return b.remaining == 0; });
+    if(b.error) std::rethrow_exception(b.error);
+}
+
+#ifdef FS_HAVE_IO_URING
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+UringEngine::UringEngine(BlockDevice &device, const uint depth)
+    :device(device), dev_fd(device.fd()), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(nullptr){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = sys_io_uring_setup(max(depth, 1U), &p);
+    if(ring_fd < 0)
+        throw runtime_error("io_uring_setup failed");
+    entries = p.sq_entries;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap) sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap ? sq_ring
+                          : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring_fd, IORING_OFF_CQ_RING);
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring_fd, IORING_OFF_SQES);
+    if(sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqe_map == MAP_FAILED){
+        if(sqe_map != MAP_FAILED) munmap(sqe_map, sqes_size);
+        if(cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if(sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+        ::close(ring_fd);
+        throw runtime_error("io_uring mmap failed");
+    }
+    sqes = static_cast<struct io_uring_sqe *>(sqe_map);
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+}
+
+UringEngine::~UringEngine(){
+    munmap(sqes, sqes_size);
+    if(cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    ::close(ring_fd);
+}
+
+//a failed or short transfer is finished synchronously on the device
+void UringEngine::finish(const Request &req, long res){
+    if(res < 0){
+        issue(device, req);
+        return;
+    }
+
+    vector<struct iovec> left(req.iov, req.iov + req.iovcnt);
+    size_t done = res;
+    size_t i = 0;
+    while(i < left.size() && done >= left[i].iov_len){
+        done -= left[i].iov_len;
+        i++;
+    }
+    if(i == left.size()) return;
+
+    left[i].iov_base = static_cast<char *>(left[i].iov_base) + done;
+    left[i].iov_len -= done;
+    Request rest = {req.write, req.pos + res, left.data() + i, static_cast<int>(left.size() - i)};
+    issue(device, rest);
+}
+
+//keep the submission queue as full as the ring allows until every request has completed
+void UringEngine::run(const vector<Request> &batch){
+    if(batch.empty()) return;
+    lock_guard<mutex> guard(lock);
+    stats.batches++;
+    stats.requests += batch.size();
+
+    size_t next = 0;
+    size_t completed = 0;
+    unsigned in_flight = 0;
+    unsigned to_submit = 0;     //queued in the ring but not yet taken by the kernel
+    while(completed < batch.size()){
+        unsigned tail = *sq_tail;
+        while(next < batch.size() && in_flight < entries){
+            const Request &req = batch[next];
+            unsigned idx = tail & *sq_mask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req.write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = dev_fd;
+            sqe->addr = reinterpret_cast<unsigned long>(req.iov);
+            sqe->len = req.iovcnt;
+            sqe->off = req.pos;
+            sqe->user_data = next;
+            sq_array[idx] = idx;
+            tail++;
+            next++;
+            in_flight++;
+            to_submit++;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        note_in_flight(in_flight);
+
+        int ret = sys_io_uring_enter(ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+        if(ret < 0 && errno != EINTR)
+            throw runtime_error("io_uring_enter failed");
+        if(ret > 0) to_submit -= ret;
+
+        unsigned head = *cq_head;
+        unsigned cq_end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while(head != cq_end){
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            finish(batch[cqe->user_data], cqe->res);
+            head++;
+            completed++;
+            in_flight--;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#endif
@@ -0,0 +1,125 @@
+/*
+An IoEngine runs batches of block I/O against a BlockDevice with many requests in
+flight at once, instead of one synchronous readv/writev after another. It contains
+1. a batch interface: every request in the batch is issued, up to depth at a time,
+   and the call returns once all of them have completed
+2. two backends:
+	- UringEngine: io_uring submission/completion rings (raw syscalls, no liburing),
+	  used when the kernel supports it and the device has a file descriptor
+	- PoolEngine: a pool of worker threads issuing the device's own readv/writev
+3. counters of batches, requests and the deepest queue reached
+*/
+
+#ifndef _IOENGINE_H_
+#define _IOENGINE_H_
+
+#include "blockDevice.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+class IoEngine{
+    public:
+        enum Type {auto_engine, uring_engine, pool_engine};
+
+        struct Request{
+            bool write;
+            off_t pos;
+            const struct iovec *iov;    //must stay valid until the batch completes
+            int iovcnt;
+        };
+
+        struct Stats{
+            std::atomic<unsigned long> batches;
+            std::atomic<unsigned long> requests;
+            std::atomic<unsigned long> max_in_flight;
+            Stats() : batches(0), requests(0), max_in_flight(0) {}
+        };
+        Stats stats;
+
+        //auto_engine picks io_uring when it can be set up and falls back to the pool
+        static std::unique_ptr<IoEngine> create(Type type, BlockDevice &device, const uint depth);
+        virtual ~IoEngine() {}
+
+        virtual void run(const std::vector<Request> &batch) = 0;
+        virtual const char *name() const = 0;
+
+    protected:
+        void note_in_flight(unsigned long n);
+};
+
+class PoolEngine : public IoEngine{
+        struct Batch{
+            std::mutex lock;
+            std::condition_variable done;
+            size_t remaining;
+            std::exception_ptr error;   //the last request that failed, rethrown by run
+        };
+        struct Task{
+            Request req;
+            Batch *batch;
+        };
+
+        BlockDevice &device;
+        std::mutex lock;
+        std::condition_variable work;
+        std::deque<Task> queue;
+        std::vector<std::thread> workers;
+        std::atomic<unsigned long> in_flight;
+        bool stopping;
+
+        void worker();
+
+    public:
+        PoolEngine(BlockDevice &device, const uint threads);
+        ~PoolEngine();
+        void run(const std::vector<Request> &batch);
+        const char *name() const { return "thread pool"; }
+};
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FS_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef FS_HAVE_IO_URING
+#include <linux/io_uring.h>
+
+class UringEngine : public IoEngine{
+        BlockDevice &device;
+        const int dev_fd;
+        int ring_fd;
+        uint entries;
+        std::mutex lock;        //one batch drives the rings at a time
+
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void finish(const Request &req, long res);
+
+    public:
+        //throws if io_uring cannot be set up, so create() can fall back
+        UringEngine(BlockDevice &device, const uint depth);
+        ~UringEngine();
+        void run(const std::vector<Request> &batch);
+        const char *name() const { return "io_uring"; }
+};
+#endif
+
+#endif
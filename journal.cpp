@@ -0,0 +1,447 @@
+#include "journal.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+using std::lock_guard;
+using std::map;
+using std::max;
+using std::min;
+using std::mutex;
+using std::unique_lock;
+using std::vector;
+
+struct Journal::DiskHeader{
+    uint32_t magic;
+    uint32_t seq;               //sequence number of the first transaction after it
+};
+
+//followed by count block numbers, then the revoked block numbers
+struct Journal::DiskDescriptor{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t revokes;
+    uint32_t checksum;          //of the block numbers, the revokes and the images
+};
+
+thread_local uint Journal::depth = 0;
+thread_local bool Journal::joined = false;
+thread_local bool Journal::changed = false;
+
+namespace {
+
+//FNV-1a, continuing from hash
+uint32_t checksum(uint32_t hash, const char *data, size_t len){
+    for(size_t i = 0; i < len; i++){
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+const uint32_t checksum_seed = 2166136261u;
+
+}
+
+Journal::Op::Op(Journal &journal, bool wait) : journal(journal){
+    journal.start_op(wait);
+}
+
+Journal::Op::~Op(){
+    journal.end_op();
+}
+
+Journal::Journal(BlockDevice &device, BlockCache &block_cache, const uint block_size, const Config &config)
+    :device(device),
+     block_cache(block_cache),
+     block_size(block_size),
+     config(config),
+     start(0),
+     blocks(0),
+     tail(0),
+     seq(1),
+     open(0),
+     closing(false),
+     stopping(false),
+     active(false),
+     requested(0),
+     synced(0){
+    this->config.interval_ms = max(this->config.interval_ms, 1U);
+    this->config.batch = max(this->config.batch, 1U);
+}
+
+Journal::~Journal(){
+    stop();
+}
+
+//about 1/64 of the image, enough for several full transactions
+uint Journal::size_for(uint num_blocks){
+    return min(max(num_blocks / 64, 16U), 4096U);
+}
+
+void Journal::format(uint start, uint blocks){
+    this->start = start;
+    this->blocks = blocks;
+    seq = 1;
+    tail = 0;
+    write_header();
+    begin();
+}
+
+uint Journal::replay(uint start, uint blocks){
+    this->start = start;
+    this->blocks = blocks;
+    tail = 0;
+
+    vector<char> block(block_size);
+    device.read(static_cast<off_t>(start) * block_size, block.data(), block_size);
+    DiskHeader header;
+    memcpy(&header, block.data(), sizeof(header));
+    seq = header.magic == header_magic ? header.seq : 1;
+
+    //collect the transactions up to the first one that is missing or torn
+    struct Found{
+        uint seq;
+        vector<uint32_t> entries;
+        vector<char> images;
+    };
+    vector<Found> found;
+    map<uint, uint> revoked_at;         //block to the last transaction revoking it
+    uint entries_per_block = (block_size - sizeof(DiskDescriptor)) / sizeof(uint32_t);
+    uint pos = 0;
+    while(header.magic == header_magic && pos < blocks - 1){
+        device.read(static_cast<off_t>(start + 1 + pos) * block_size, block.data(), block_size);
+        DiskDescriptor desc;
+        memcpy(&desc, block.data(), sizeof(desc));
+        if(desc.magic != descriptor_magic || desc.seq != seq
+           || desc.count + desc.revokes > entries_per_block || pos + 1 + desc.count > blocks - 1){
+            break;
+        }
+
+        Found txn;
+        txn.seq = seq;
+        txn.entries.resize(desc.count + desc.revokes);
+        memcpy(txn.entries.data(), block.data() + sizeof(desc), txn.entries.size() * sizeof(uint32_t));
+        txn.images.resize(static_cast<size_t>(desc.count) * block_size);
+        if(desc.count > 0){
+            device.read(static_cast<off_t>(start + 2 + pos) * block_size, txn.images.data(), txn.images.size());
+        }
+        uint32_t sum = checksum(checksum_seed, reinterpret_cast<const char *>(txn.entries.data()),
+                                txn.entries.size() * sizeof(uint32_t));
+        sum = checksum(sum, txn.images.data(), txn.images.size());
+        if(sum != desc.checksum) break;
+
+        for(uint r = desc.count; r < txn.entries.size(); r++){
+            revoked_at[txn.entries[r]] = seq;
+        }
+        found.push_back(std::move(txn));
+        pos += 1 + desc.count;
+        seq++;
+    }
+
+    //in order, skipping images that a later revoke made stale
+    for(auto &txn : found){
+        uint count = txn.images.size() / block_size;
+        for(uint i = 0; i < count; i++){
+            auto r = revoked_at.find(txn.entries[i]);
+            if(r != revoked_at.end() && r->second >= txn.seq) continue;
+            block_cache.write(static_cast<off_t>(txn.entries[i]) * block_size,
+                              txn.images.data() + static_cast<size_t>(i) * block_size, block_size);
+        }
+    }
+    if(!found.empty()) block_cache.sync();
+
+    write_header();
+    begin();
+    return found.size();
+}
+
+void Journal::begin(){
+    if(!config.enabled) return;
+    lock_guard<mutex> guard(lock);
+    stopping = false;
+    active = true;
+    committer = std::thread(&Journal::run, this);
+}
+
+void Journal::stop(){
+    {
+        lock_guard<mutex> guard(lock);
+        if(!committer.joinable()) return;
+        stopping = true;
+    }
+    wake.notify_one();
+    committer.join();
+    {
+        lock_guard<mutex> guard(lock);
+        active = false;
+    }
+    committed.notify_all();
+    if(!failure) checkpoint();
+}
+
+void Journal::start_op(bool wait){
+    if(!config.enabled || depth++ > 0) return;
+    changed = false;
+    joined = false;
+    unique_lock<mutex> guard(lock);
+    if(!active) return;
+    if(wait) opened.wait(guard, [&] { return !closing; });
+    open++;
+    joined = true;
+}
+
+void Journal::end_op(){
+    if(!config.enabled || --depth > 0) return;
+    lock_guard<mutex> guard(lock);
+    if(!joined) return;         //started while the journal was not running
+    open--;
+    if(changed) running.ops++;
+    if(open == 0) drained.notify_all();
+    if(full()) wake.notify_one();
+}
+
+//the entries of one descriptor block, as many iovecs as a device writev takes,
+//and room in the log next to the header
+uint Journal::max_blocks() const{
+    uint entries = (block_size - sizeof(DiskDescriptor)) / sizeof(uint32_t);
+    return min(min(entries, static_cast<uint>(IOV_MAX) - 1), blocks - 2);
+}
+
+//the running transaction is closed when this holds; lock held
+bool Journal::full() const{
+    return running.ops >= config.batch || 2 * (running.blocks.size() + running.revoked.size()) >= max_blocks();
+}
+
+void Journal::read(off_t pos, char *dst, size_t len){
+    lock_guard<mutex> guard(lock);
+    if(!active){
+        block_cache.read(pos, dst, len);
+        return;
+    }
+    while(len > 0){
+        uint block = pos / block_size;
+        uint offset = pos % block_size;
+        size_t piece = min(len, static_cast<size_t>(block_size - offset));
+        auto it = running.blocks.find(block);
+        if(it == running.blocks.end()){
+            it = committing.blocks.find(block);
+            if(it == committing.blocks.end()) it = running.blocks.end();
+        }
+        if(it != running.blocks.end()){
+            memcpy(dst, it->second.data() + offset, piece);
+        } else{
+            block_cache.read(pos, dst, piece);
+        }
+        pos += piece;
+        dst += piece;
+        len -= piece;
+    }
+}
+
+//The first change to a block in a transaction copies its newest image: the one being
+//committed, the cached one, or zeroes for a block that was just allocated.
+void Journal::write(off_t pos, const char *src, size_t len, bool fresh){
+    lock_guard<mutex> guard(lock);
+    if(!active){
+        block_cache.write(pos, src, len, fresh);
+        return;
+    }
+    if(depth > 0) changed = true;
+    while(len > 0){
+        uint block = pos / block_size;
+        uint offset = pos % block_size;
+        size_t piece = min(len, static_cast<size_t>(block_size - offset));
+        auto it = running.blocks.find(block);
+        if(it == running.blocks.end()){
+            vector<char> image(block_size, 0);
+            auto c = committing.blocks.find(block);
+            if(fresh || piece == block_size){
+                //every byte is either overwritten or starts as zero
+            } else if(c != committing.blocks.end()){
+                image = c->second;
+            } else{
+                block_cache.read(static_cast<off_t>(block) * block_size, image.data(), block_size);
+            }
+            it = running.blocks.emplace(block, std::move(image)).first;
+            running.revoked.erase(block);
+        }
+        memcpy(it->second.data() + offset, src, piece);
+        pos += piece;
+        src += piece;
+        len -= piece;
+    }
+}
+
+void Journal::revoke(uint block, uint count){
+    lock_guard<mutex> guard(lock);
+    if(!active) return;
+    for(uint b = block; b < block + count; b++){
+        running.blocks.erase(b);
+        if(logged.count(b) || committing.blocks.count(b)) running.revoked.insert(b);
+    }
+}
+
+void Journal::commit(){
+    unique_lock<mutex> guard(lock);
+    if(!active){
+        if(failure) std::rethrow_exception(failure);
+        return;
+    }
+    unsigned long ticket = ++requested;
+    counters.waits++;
+    wake.notify_one();
+    committed.wait(guard, [&] { return synced >= ticket || !active; });
+    if(failure) std::rethrow_exception(failure);
+}
+
+void Journal::tune(uint interval_ms, uint batch){
+    {
+        lock_guard<mutex> guard(lock);
+        config.interval_ms = max(interval_ms, 1U);
+        config.batch = max(batch, 1U);
+    }
+    wake.notify_one();
+}
+
+Journal::Config Journal::settings(){
+    lock_guard<mutex> guard(lock);
+    return config;
+}
+
+Journal::Stats Journal::stats(){
+    lock_guard<mutex> guard(lock);
+    return counters;
+}
+
+//The commit thread. Closing a transaction waits for the operations in it to finish
+//and holds back new ones; the log is written with the lock dropped, so operations
+//carry on in the next transaction meanwhile.
+void Journal::run(){
+    unique_lock<mutex> guard(lock);
+    while(true){
+        wake.wait_for(guard, std::chrono::milliseconds(config.interval_ms),
+                      [&] { return stopping || full() || requested > synced; });
+        unsigned long target = requested;
+        bool pending = !running.blocks.empty() || !running.revoked.empty();
+        if(!pending && target == synced){
+            if(stopping) break;
+            continue;
+        }
+
+        try{
+            if(pending){
+                closing = true;
+                drained.wait(guard, [&] { return open == 0; });
+                committing = std::move(running);
+                running = Transaction();
+                closing = false;
+                opened.notify_all();
+
+                guard.unlock();
+                write_out(committing);
+                guard.lock();
+                install(committing);
+                committing = Transaction();
+            } else{
+                guard.unlock();
+                device.sync();
+                guard.lock();
+                counters.syncs++;
+            }
+        } catch(...){
+            //give up journaling; waiters see the error and metadata goes straight to the cache
+            if(!guard.owns_lock()) guard.lock();
+            failure = std::current_exception();
+            closing = false;
+            active = false;
+            opened.notify_all();
+            committed.notify_all();
+            break;
+        }
+        synced = max(synced, target);
+        committed.notify_all();
+    }
+}
+
+//append the transaction to the log and sync, making room with a checkpoint first
+void Journal::write_out(Transaction &txn){
+    uint count = txn.blocks.size();
+    if(count + txn.revoked.size() > max_blocks()){
+        //too big for the log: write it home directly, without the atomicity
+        {
+            lock_guard<mutex> guard(lock);
+            install(txn);
+            counters.overflows++;
+            counters.ops += txn.ops;
+        }
+        txn.blocks.clear();
+        block_cache.sync();
+        device.sync();
+        return;
+    }
+    if(tail + 1 + count > blocks - 1) checkpoint();
+
+    vector<uint32_t> entries;
+    entries.reserve(count + txn.revoked.size());
+    for(auto &kv : txn.blocks) entries.push_back(kv.first);
+    for(uint b : txn.revoked) entries.push_back(b);
+
+    uint32_t sum = checksum(checksum_seed, reinterpret_cast<const char *>(entries.data()),
+                            entries.size() * sizeof(uint32_t));
+    for(auto &kv : txn.blocks) sum = checksum(sum, kv.second.data(), block_size);
+
+    vector<char> desc_block(block_size, 0);
+    DiskDescriptor desc = {descriptor_magic, seq, count, static_cast<uint32_t>(txn.revoked.size()), sum};
+    memcpy(desc_block.data(), &desc, sizeof(desc));
+    memcpy(desc_block.data() + sizeof(desc), entries.data(), entries.size() * sizeof(uint32_t));
+
+    vector<struct iovec> iov;
+    iov.reserve(count + 1);
+    iov.push_back(iovec{desc_block.data(), block_size});
+    for(auto &kv : txn.blocks) iov.push_back(iovec{kv.second.data(), block_size});
+    device.writev(static_cast<off_t>(start + 1 + tail) * block_size, iov.data(), iov.size());
+    device.sync();
+
+    tail += 1 + count;
+    seq++;
+    lock_guard<mutex> guard(lock);
+    for(auto &kv : txn.blocks) logged.insert(kv.first);
+    counters.commits++;
+    counters.syncs++;
+    counters.ops += txn.ops;
+    counters.blocks += count;
+}
+
+//hand committed images to the cache, except blocks freed since; lock held
+void Journal::install(Transaction &txn){
+    for(auto &kv : txn.blocks){
+        if(running.revoked.count(kv.first)) continue;
+        block_cache.write(static_cast<off_t>(kv.first) * block_size, kv.second.data(), block_size);
+    }
+}
+
+//once every logged block is home the log can start over
+void Journal::checkpoint(){
+    block_cache.sync();
+    device.sync();
+    {
+        lock_guard<mutex> guard(lock);
+        logged.clear();
+        counters.checkpoints++;
+    }
+    tail = 0;
+    write_header();
+}
+
+void Journal::write_header(){
+    vector<char> block(block_size, 0);
+    DiskHeader header = {header_magic, seq};
+    memcpy(block.data(), &header, sizeof(header));
+    device.write(static_cast<off_t>(start) * block_size, block.data(), block_size);
+    device.sync();
+}
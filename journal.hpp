@@ -0,0 +1,150 @@
+/*
+The Journal is a write-ahead log of metadata kept in a region of the image. It contains
+1. the running transaction: the latest image of every metadata block changed since the
+   last commit, held in memory and read in place of the cached block
+2. operations: a namespace change (mkdir, link, a write allocating blocks, ...) is
+   one Op, and a transaction only ever holds whole operations
+3. group commit: a commit thread closes the running transaction once it holds batch
+   operations, once interval_ms have passed or once someone waits for it, and appends
+   it to the log with one sequential write and one device sync; only then are the
+   blocks handed to the block cache, which writes them home whenever it likes
+4. a checkpoint when the log is full: the cache is synced, so everything logged is home,
+   and the log starts over
+5. revokes: a logged block that is freed (and may come back as file data) is recorded
+   so replay does not write stale metadata over it
+6. replay on mount: every complete transaction after the last checkpoint is written
+   home again, in order; a torn transaction fails its checksum and ends the log
+On the image the region is a header block followed by transactions, each a
+descriptor block (sequence number, block numbers, revokes, checksum) and the images.
+*/
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "blockCache.hpp"
+#include "blockDevice.hpp"
+
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+class Journal{
+    public:
+        struct Config{
+            bool enabled;
+            uint interval_ms;       //longest a finished operation waits to be committed
+            uint batch;             //operations in a transaction before it is closed
+            Config() : enabled(true), interval_ms(100), batch(256) {}
+        };
+
+        struct Stats{
+            unsigned long commits = 0;
+            unsigned long ops = 0;              //operations that changed metadata
+            unsigned long blocks = 0;           //block images appended to the log
+            unsigned long syncs = 0;            //device syncs made by commits
+            unsigned long waits = 0;            //calls to commit
+            unsigned long checkpoints = 0;
+            unsigned long overflows = 0;        //transactions too big for the log, written home instead
+        };
+
+        //Brackets one operation so it lands in a single transaction. A thread may nest
+        //them; only the outermost counts. With wait, a new operation waits while the
+        //running transaction is being closed; callers holding locks pass false.
+        class Op{
+                Journal &journal;
+            public:
+                explicit Op(Journal &journal, bool wait = true);
+                ~Op();
+        };
+
+        Journal(BlockDevice &device, BlockCache &block_cache, const uint block_size, const Config &config);
+        ~Journal();
+
+        //log blocks for an image of num_blocks
+        static uint size_for(uint num_blocks);
+
+        //start an empty log in [start, start + blocks)
+        void format(uint start, uint blocks);
+        //write home every committed transaction in [start, start + blocks) and start an
+        //empty log there; returns how many transactions were replayed
+        uint replay(uint start, uint blocks);
+        //commit everything, stop the commit thread and checkpoint, leaving the log empty
+        void stop();
+
+        //metadata I/O at byte position pos; fresh as for BlockCache::write
+        void read(off_t pos, char *dst, size_t len);
+        void write(off_t pos, const char *src, size_t len, bool fresh = false);
+        //blocks [block, block + count) were freed
+        void revoke(uint block, uint count);
+        //wait until every finished operation is committed and the device synced;
+        //must not be called inside an Op
+        void commit();
+
+        void tune(uint interval_ms, uint batch);
+        bool enabled() const { return config.enabled; }
+        Config settings();
+        uint size() const { return blocks; }
+        Stats stats();
+
+        //on-disk structures, defined with the code that reads and writes them
+        struct DiskHeader;
+        struct DiskDescriptor;
+
+    private:
+        struct Transaction{
+            std::map<uint, std::vector<char> > blocks;     //block number to its newest image
+            std::set<uint> revoked;
+            unsigned long ops = 0;
+        };
+
+        static const uint header_magic = 0x4a524e4c;        //"JRNL"
+        static const uint descriptor_magic = 0x4a54584e;    //"JTXN"
+        static thread_local uint depth;                     //Ops open on this thread
+        static thread_local bool joined;                    //whether the outermost Op was counted in open
+        static thread_local bool changed;                   //whether the outermost Op wrote anything
+
+        BlockDevice &device;
+        BlockCache &block_cache;
+        const uint block_size;
+        Config config;
+        uint start;
+        uint blocks;
+        uint tail;                  //next free block of the log, after the header
+        uint seq;                   //sequence number of the next transaction
+
+        std::mutex lock;
+        std::condition_variable wake;       //the commit thread has work
+        std::condition_variable drained;    //no operation is open
+        std::condition_variable opened;     //operations may start again
+        std::condition_variable committed;  //a commit finished
+        Transaction running;
+        Transaction committing;
+        std::set<uint> logged;              //blocks in the log since the last checkpoint
+        uint open;
+        bool closing;
+        bool stopping;
+        bool active;                        //the commit thread runs; otherwise I/O goes straight to the cache
+        std::exception_ptr failure;         //what stopped the commit thread, if it failed
+        unsigned long requested;            //commit() calls so far
+        unsigned long synced;               //commit() calls covered by a finished commit
+        Stats counters;
+        std::thread committer;
+
+        void begin();
+        void start_op(bool wait);
+        void end_op();
+        bool full() const;
+        uint max_blocks() const;
+        void run();
+        void write_out(Transaction &txn);
+        void install(Transaction &txn);
+        void checkpoint();
+        void write_header();
+};
+
+#endif
@@ -1,6 +1,11 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <string>
-#include <sstream>
+#include <unordered_map>
 #include <vector>
 #include "fsImple.hpp"
 
@@ -9,23 +14,30 @@ using std::cin;
 using std::cout;
 using std::endl;
 using std::getline;
-using std::istringstream;
-using std::make_shared;
-using std::shared_ptr;
+using std::ifstream;
+using std::istream;
+using std::map;
+using std::setw;
+using std::streambuf;
 using std::string;
+using std::unordered_map;
 using std::vector;
+using std::chrono::duration;
+using std::chrono::steady_clock;
 
 const string PRMPT = "sh> ";
 const uint DISKSIZE = 100000000;
 const uint BLOCKSIZE = 1024;
-const uint DIRECTBLOCKS = 100;
+const uint CACHEBLOCKS = 4096;
+//bytes of command output batch mode gathers before writing them out
+const size_t BATCH_OUTPUT = 1 << 16;
 
-int test_fs(const string filename) {
-  FSImp myfs(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS);
+int test_fs(const string filename, BlockDevice::Type device) {
+  FSImp myfs(filename, DISKSIZE, BLOCKSIZE, CACHEBLOCKS, device);
 
-  myfs.mkdir({"mkdir", "dir-2"});
-  myfs.mkdir({"mkdir", "dir-2/dir-b"});
-  myfs.mkdir({"mkdir", "dir-2/dir-b/dir-deep"});
+  myfs.mkdir("dir-2");
+  myfs.mkdir("dir-2/dir-b");
+  myfs.mkdir("dir-2/dir-b/dir-deep");
   myfs.open({"open", "somefile", "w"});
   myfs.open({"open", "somefile2", "w"});
   myfs.write({"write", "0", "hi there buddy"});
@@ -42,14 +54,14 @@ int test_fs(const string filename) {
   myfs.cat({"cat", "ex.txt"});
   myfs.link({"link", "ex.txt", "/dir-2/dir-b/linked"});
   myfs.cat({"cat", "/dir-2/dir-b/linked"});
-  myfs.cp({"cp", "ex.txt", "newEx.txt"});
-  myfs.unlink({"unlink", "ex.txt"});
+  myfs.copy({"cp", "ex.txt", "newEx.txt"});
+  myfs.unlink("ex.txt");
   myfs.tree({"tree"});
   myfs.stat({"stat", "somefile", "somefile2", "dir-2/dir-b/linked"});
-  myfs.unlink({"unlink", "dir-2/dir-b/linked"});
+  myfs.unlink("dir-2/dir-b/linked");
   myfs.rmdir({"rmdir", "dir-2/dir-b/dir-deep", "dir-2/dir-b", "dir-2"});
   myfs.tree({"tree"});
-  myfs.mkdir({"mkdir", "ant"});
+  myfs.mkdir("ant");
   myfs.cd({"cd", "ant"});
   myfs.printwd({"pwd"});
   myfs.tree({"tree"});
@@ -57,82 +69,107 @@ int test_fs(const string filename) {
   return 0;
 }
 
-void repl(const string filename) {
+typedef void (FSImp::*Command)(vector<string>);
 
-  FSImp *fs = new FSImp(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS);
+//the commands that map straight onto an FSImp method; mkfs, write and exit need the shell
+const unordered_map<string, Command> COMMANDS = {
+    {"open", &FSImp::open},
+    {"read", &FSImp::read},
+    {"write", &FSImp::write},
+    {"seek", &FSImp::seek},
+    {"fallocate", &FSImp::fallocate},
+    {"close", &FSImp::close},
+    {"mkdir", &FSImp::mkdir},
+    {"rmdir", &FSImp::rmdir},
+    {"cd", &FSImp::cd},
+    {"link", &FSImp::link},
+    {"unlink", &FSImp::unlink},
+    {"stat", &FSImp::stat},
+    {"ls", &FSImp::ls},
+    {"cat", &FSImp::cat},
+    {"cp", &FSImp::copy},
+    {"tree", &FSImp::tree},
+    {"pwd", &FSImp::printwd},
+    {"sync", &FSImp::sync},
+    {"cache", &FSImp::cache},
+    {"frag", &FSImp::frag},
+    {"journal", &FSImp::journaling},
+    {"wbuf", &FSImp::buffering},
+    {"readahead", &FSImp::prefetching},
+    {"mem", &FSImp::memory},
+    {"pack", &FSImp::packing},
+};
+
+//split cmd into its whitespace separated words
+void tokenize(const string &cmd, vector<string> &args) {
+    args.clear();
+    size_t end = 0;
+    while (true) {
+        size_t start = cmd.find_first_not_of(" \t\r", end);
+        if (start == string::npos) return;
+        end = cmd.find_first_of(" \t\r", start);
+        args.push_back(cmd.substr(start, end == string::npos ? string::npos : end - start));
+    }
+}
+
+//run the command line cmd, split into args; false once it asks to exit
+bool run(FSImp *&fs, const string &filename, BlockDevice::Type device, const string &cmd, vector<string> &args) {
+    if (args[0] == "exit") {
+        return false;
+    } else if (args[0] == "mkfs") {
+        if (args.size() == 1) {
+            //start over on an empty image instead of mounting the old one
+            delete(fs);
+            remove(filename.c_str());
+            fs = new FSImp(filename, DISKSIZE, BLOCKSIZE, CACHEBLOCKS, device);
+        } else {
+            cerr << "mkfs: too many operands" << endl;
+        }
+        return true;
+    } else if (args[0] == "write") {
+        //the text to write may be quoted and hold spaces
+        if(args.size() >= 3) {
+          auto start = cmd.find("\"");
+          auto end = cmd.find("\"", start+1);
+          if (start != string::npos && end != string::npos) {
+            string w_str = cmd.substr(start+1, end-start-1);
+            auto rn = cmd.find_first_not_of(" \t",end+1);
+            if (rn != string::npos) {
+              args = {args[0], args[1], w_str, cmd.substr(rn)};
+            } else {
+              args = {args[0], args[1], w_str};
+            }
+          }
+        } else {
+          args = {"write"};
+        }
+    }
+
+    auto command = COMMANDS.find(args[0]);
+    if (command == COMMANDS.end()) {
+        cout << "unknown command: " << args[0] << endl;
+    } else {
+        (fs->*command->second)(args);
+    }
+    return true;
+}
+
+void repl(const string filename, BlockDevice::Type device) {
+
+  FSImp *fs = new FSImp(filename, DISKSIZE, BLOCKSIZE, CACHEBLOCKS, device);
 
     string cmd;
     vector<string> args;
-    string token;
 
     cout << PRMPT;
     while (getline(cin, cmd)) {
-        args.clear();
-        istringstream iss(cmd);
-        while (iss >> token) { args.push_back(token); }
+        tokenize(cmd, args);
         if (args.size() == 0) {
             cout << PRMPT;
             continue;
         }
-
-        if (args[0] == "mkfs") {
-            if (args.size() == 1) {
-                delete(fs);
-                fs = new FSImp(filename, DISKSIZE, BLOCKSIZE, DIRECTBLOCKS);
-            } else {
-                cerr << "mkfs: too many operands" << endl;
-            }
-        } else if (args[0] == "open") {
-            fs->open(args);
-        } else if (args[0] == "read") {
-            fs->read(args);
-        } else if (args[0] == "write") {
-            if(args.size() >= 3) {
-              auto start = cmd.find("\"");
-              auto end = cmd.find("\"", start+1);
-              if (start != string::npos && end != string::npos) {
-                string w_str = cmd.substr(start+1, end-start-1);
-                auto rn = cmd.find_first_not_of(" \t",end+1);
-                if (rn != string::npos) {
-                  args = {args[0], args[1], w_str, cmd.substr(rn)};
-                } else {
-                  args = {args[0], args[1], w_str};
-                }
-              }
-            } else {
-              args = {"write"};
-            }
-            fs->write(args);
-        } else if (args[0] == "seek") {
-            fs->seek(args);
-        } else if (args[0] == "close") {
-            fs->close(args);
-        } else if (args[0] == "mkdir") {
-            fs->mkdir(args);
-        } else if (args[0] == "rmdir") {
-            fs->rmdir(args);
-        } else if (args[0] == "cd") {
-            fs->cd(args);
-        } else if (args[0] == "link") {
-            fs->link(args);
-        } else if (args[0] == "unlink") {
-            fs->unlink(args);
-        } else if (args[0] == "stat") {
-            fs->stat(args);
-        } else if (args[0] == "ls") {
-            fs->ls(args);
-        } else if (args[0] == "cat") {
-            fs->cat(args);
-        } else if (args[0] == "cp") {
-            fs->cp(args);
-        } else if (args[0] == "tree") {
-            fs->tree(args);
-        } else if (args[0] == "exit") {
+        if (!run(fs, filename, device, cmd, args)) {
             break;
-        } else if (args[0] == "pwd") {
-            fs->printwd(args);
-        } else {
-            cout << "unknown command: " << args[0] << endl;
         }
         cout << PRMPT;
     }
@@ -141,16 +178,119 @@ void repl(const string filename) {
     return;
 }
 
+//Holds what is written to it until BATCH_OUTPUT bytes have gathered or it is drained,
+//so the endl after every line of command output does not cost a write of its own
+class BatchOutput : public streambuf {
+  public:
+    explicit BatchOutput(streambuf *out) : out(out), buffer(BATCH_OUTPUT) {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+    ~BatchOutput() { drain(); }
+
+    void drain() {
+        out->sputn(pbase(), pptr() - pbase());
+        setp(buffer.data(), buffer.data() + buffer.size());
+        out->pubsync();
+    }
+
+  protected:
+    int overflow(int c) override {
+        out->sputn(pbase(), pptr() - pbase());
+        setp(buffer.data(), buffer.data() + buffer.size());
+        if (c != traits_type::eof()) {
+            sputc(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+    //flushes only gather more
+    int sync() override { return 0; }
+
+  private:
+    streambuf *out;
+    vector<char> buffer;
+};
+
+//Run the commands in script, one per line and "-" for stdin, with no prompt and the
+//output buffered, then print how many times each command ran and how long it took.
+//Errors go to stderr as they happen, so they may come before the output around them.
+int batch(const string filename, BlockDevice::Type device, const string &script) {
+    ifstream file;
+    if (script != "-") {
+        file.open(script);
+        if (!file) {
+            cerr << "batch: cannot open " << script << endl;
+            return 1;
+        }
+    }
+    istream &in = script == "-" ? cin : file;
+
+    struct Timing {
+        unsigned long calls = 0;
+        double ms = 0;
+    };
+    map<string, Timing> timings;
+
+    BatchOutput output(cout.rdbuf());
+    auto old_buf = cout.rdbuf(&output);
+    FSImp *fs = new FSImp(filename, DISKSIZE, BLOCKSIZE, CACHEBLOCKS, device);
+
+    string cmd;
+    vector<string> args;
+    while (getline(in, cmd)) {
+        tokenize(cmd, args);
+        if (args.size() == 0) continue;
+        string name = args[0];
+        auto start = steady_clock::now();
+        bool more = run(fs, filename, device, cmd, args);
+        auto end = steady_clock::now();
+        Timing &timing = timings[name];
+        timing.calls++;
+        timing.ms += duration<double, std::milli>(end - start).count();
+        if (!more) break;
+    }
+
+    delete(fs);
+    output.drain();
+    cout.rdbuf(old_buf);
+
+    cerr << setw(12) << std::left << "command" << std::right << setw(10) << "calls"
+         << setw(14) << "total ms" << setw(12) << "mean us" << endl;
+    for (auto &kv : timings) {
+        cerr << setw(12) << std::left << kv.first << std::right << setw(10) << kv.second.calls
+             << std::fixed << std::setprecision(2) << setw(14) << kv.second.ms
+             << setw(12) << 1000 * kv.second.ms / kv.second.calls << endl;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        cerr << "usage: " << argv[0] << " filename" << endl;
+    auto device = BlockDevice::posix_dev;
+    string script;
+    int arg = 1;
+    for (; arg < argc - 1; arg++) {
+        string opt = argv[arg];
+        if (opt == "-mmap") {
+            device = BlockDevice::mmap_dev;
+        } else if (opt == "-fstream") {
+            device = BlockDevice::fstream_dev;
+        } else if (opt == "-batch" && arg + 1 < argc - 1) {
+            script = argv[++arg];
+        } else {
+            break;
+        }
+    }
+    if (arg != argc - 1) {
+        cerr << "usage: " << argv[0] << " [-mmap | -fstream] [-batch script | -batch -] filename" << endl;
         return 1;
     }
 
 #ifdef DEBUG
-    test_fs(string(argv[1]));
+    test_fs(string(argv[argc - 1]), device);
 #else
-    repl(string(argv[1]));
+    if (!script.empty()) {
+        return batch(string(argv[argc - 1]), device, script);
+    }
+    repl(string(argv[argc - 1]), device);
 #endif
     return 0;
 }
@@ -0,0 +1,124 @@
+#include "readAhead.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::pair;
+using std::shared_ptr;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+const uint ReadAhead::min_window;
+const uint ReadAhead::max_queued;
+
+ReadAhead::ReadAhead(BlockCache &block_cache, const uint block_size, const uint max_window)
+    :block_cache(block_cache),
+     block_size(block_size),
+     max_window(max_window),
+     stopping(false),
+     worker(&ReadAhead::run, this){}
+
+ReadAhead::~ReadAhead(){
+    stop();
+}
+
+void ReadAhead::note(Stream &stream, const shared_ptr<Inode> &inode, uint pos, uint len, uint size){
+    uint limit = max_window;
+    if(limit == 0 || len == 0) return;
+    stats.reads++;
+    if(pos != stream.next){
+        reset(stream, pos + len);
+        return;
+    }
+    stats.sequential++;
+    stream.next = pos + len;
+    *stream.reader = stream.next;
+
+    //start a window past this read, or the next one once the reader is halfway into the last
+    uint start = stream.next;
+    if(stream.window == 0){
+        stream.window = min(static_cast<uint>(min_window), limit);
+    } else if(static_cast<unsigned long>(stream.next) + stream.window / 2 * block_size >= stream.fetched){
+        stream.window = min(2 * stream.window, limit);
+        start = std::max(start, stream.fetched);
+    } else{
+        return;
+    }
+    if(start >= size) return;
+
+    uint window_len = min(static_cast<unsigned long>(size - start), static_cast<unsigned long>(stream.window) * block_size);
+    stream.fetched = start + window_len;
+    {
+        lock_guard<mutex> guard(lock);
+        if(queue.size() >= max_queued){
+            stats.dropped++;
+            return;
+        }
+        queue.push_back(Job{inode, stream.reader, start, window_len});
+    }
+    stats.windows++;
+    wake.notify_one();
+}
+
+void ReadAhead::reset(Stream &stream, uint pos){
+    stream.next = pos;
+    *stream.reader = pos;
+    stream.window = 0;
+    stream.fetched = pos;
+}
+
+void ReadAhead::set_max_window(uint blocks){
+    max_window = blocks;
+}
+
+void ReadAhead::stop(){
+    {
+        lock_guard<mutex> guard(lock);
+        if(stopping) return;
+        stopping = true;
+        queue.clear();
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+//Reading ahead is only a hint: a window whose file is gone is skipped, and one that
+//fails is left for the reader, which gets the error when it reads the blocks itself.
+void ReadAhead::run(){
+    vector<pair<off_t, size_t> > ranges;
+    unique_lock<mutex> guard(lock);
+    while(true){
+        wake.wait(guard, [this]{ return stopping || !queue.empty(); });
+        if(stopping) return;
+        Job job = queue.front();
+        queue.pop_front();
+        guard.unlock();
+
+        //blocks behind the reader were read without us; load only what is still ahead
+        uint reader = *job.reader;
+        if(reader > job.pos){
+            uint skip = min(reader - job.pos, job.len) / block_size * block_size;
+            if(skip == job.len) stats.late++;
+            job.pos += skip;
+            job.len -= skip;
+        }
+        auto inode = job.len > 0 ? job.inode.lock() : nullptr;
+        if(inode){
+            try{
+                //the read lock keeps the blocks from being freed and reused while they load
+                ReadGuard inode_guard(inode->lock);
+                uint len = job.pos < inode->size ? min(job.len, inode->size - job.pos) : 0;
+                inode->image_ranges(job.pos, len, ranges);
+                block_cache.prefetch(ranges, true);
+            } catch(...){
+            }
+        }
+        inode.reset();
+        guard.lock();
+    }
+}
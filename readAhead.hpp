@@ -0,0 +1,90 @@
+/*
+ReadAhead fetches the blocks a sequential reader is about to ask for before it asks.
+It contains
+1. a Stream per descriptor: where the next read would start if the reader keeps
+   going, the size of the last window and how far ahead it has been fetched
+2. the window policy: a read starting where the last one ended is sequential; the
+   first sequential read asks for min_window blocks past it, and each time the reader
+   gets into the second half of what was fetched the next window, twice as large up
+   to max_window, is asked for; any other read or a seek starts over
+3. a worker thread that maps each window to image ranges under the inode's read lock
+   and loads them into the block cache as one engine batch, so the reader copies one
+   window while the next is on its way; windows that find the queue full are dropped
+   and the part of a window the reader has already passed is skipped
+4. counters of reads, sequential reads, windows, and windows dropped or overtaken by the
+   reader before the worker got to them; how many of the
+   fetched blocks were used is counted by the block cache
+*/
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include "blockCache.hpp"
+#include "inode.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <sys/types.h>
+
+class ReadAhead{
+    public:
+        struct Stream{
+            uint next = 0;      //byte where a sequential read would start
+            uint window = 0;    //blocks in the last window, 0 while reads look random
+            uint fetched = 0;   //bytes before this have been asked for
+            //next, shared with the queued windows so the worker skips what the reader has passed
+            std::shared_ptr<std::atomic<uint> > reader = std::make_shared<std::atomic<uint> >(0);
+        };
+
+        struct Stats{
+            std::atomic<unsigned long> reads;
+            std::atomic<unsigned long> sequential;
+            std::atomic<unsigned long> windows;
+            std::atomic<unsigned long> dropped;
+            std::atomic<unsigned long> late;        //windows the reader got to first
+            Stats() : reads(0), sequential(0), windows(0), dropped(0), late(0) {}
+        };
+        Stats stats;
+
+        ReadAhead(BlockCache &block_cache, const uint block_size, const uint max_window);
+        ~ReadAhead();
+
+        //[pos, pos + len) of inode, size bytes long, was just read through stream;
+        //queue the next window if the reads look sequential
+        void note(Stream &stream, const std::shared_ptr<Inode> &inode, uint pos, uint len, uint size);
+        //the reader moved elsewhere
+        static void reset(Stream &stream, uint pos);
+        //largest window in blocks; 0 turns reading ahead off
+        void set_max_window(uint blocks);
+        uint get_max_window() const { return max_window; }
+        //drop the queued windows and wait for the worker to finish
+        void stop();
+
+    private:
+        struct Job{
+            std::weak_ptr<Inode> inode;
+            std::shared_ptr<std::atomic<uint> > reader;
+            uint pos;
+            uint len;
+        };
+
+        static const uint min_window = 4;
+        static const uint max_queued = 64;
+        BlockCache &block_cache;
+        const uint block_size;
+        std::atomic<uint> max_window;
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<Job> queue;
+        bool stopping;
+        std::thread worker;
+
+        void run();
+};
+
+#endif
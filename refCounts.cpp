@@ -0,0 +1,150 @@
+#include "refCounts.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <iterator>
+
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::next;
+using std::prev;
+using std::vector;
+
+//make block the first block of its run, if a run covers it
+void RefCounts::split(uint block){
+    auto it = runs.upper_bound(block);
+    if(it == runs.begin()) return;
+    it = prev(it);
+    uint end = it->first + it->second.length;
+    if(it->first == block || end <= block) return;
+
+    runs[block] = Run{end - block, it->second.refs};
+    it->second.length = block - it->first;
+}
+
+//join neighbouring runs with the same count from the run before first up to end
+void RefCounts::merge(uint first, uint end){
+    auto it = runs.lower_bound(first);
+    if(it != runs.begin()) it = prev(it);
+    while(it != runs.end() && it->first <= end){
+        auto after = next(it);
+        if(after == runs.end()) break;
+        if(it->first + it->second.length == after->first && it->second.refs == after->second.refs){
+            it->second.length += after->second.length;
+            runs.erase(after);
+        } else{
+            it = after;
+        }
+    }
+}
+
+bool RefCounts::add(const vector<FreeNode> &blocks){
+    lock_guard<mutex> guard(lock);
+    for(auto &b : blocks){
+        uint pos = b.pos;
+        uint end = b.pos + b.num_blocks;
+        while(pos < end){
+            uint same;
+            uint count = 1;
+            auto it = runs.upper_bound(pos);
+            if(it != runs.begin() && prev(it)->first + prev(it)->second.length > pos){
+                it = prev(it);
+                count = it->second.refs;
+                same = it->first + it->second.length - pos;
+            } else{
+                same = it == runs.end() ? end - pos : it->first - pos;
+            }
+            if(count + 1 > max_refs) return false;
+            pos += min(same, end - pos);
+        }
+    }
+
+    for(auto &b : blocks){
+        uint end = b.pos + b.num_blocks;
+        split(b.pos);
+        split(end);
+        uint pos = b.pos;
+        while(pos < end){
+            auto it = runs.lower_bound(pos);
+            if(it != runs.end() && it->first == pos){
+                it->second.refs++;
+                pos += it->second.length;
+            } else{
+                //a gap: blocks with their single owner so far
+                uint gap_end = it == runs.end() ? end : min(end, it->first);
+                runs[pos] = Run{gap_end - pos, 2};
+                pos = gap_end;
+            }
+        }
+        merge(b.pos, end);
+    }
+    return true;
+}
+
+void RefCounts::drop(uint start, uint count, vector<FreeNode> &freed){
+    lock_guard<mutex> guard(lock);
+    uint end = start + count;
+    split(start);
+    split(end);
+    uint pos = start;
+    while(pos < end){
+        auto it = runs.lower_bound(pos);
+        if(it != runs.end() && it->first == pos){
+            pos += it->second.length;
+            if(--it->second.refs == 1) runs.erase(it);
+        } else{
+            uint gap_end = it == runs.end() ? end : min(end, it->first);
+            if(!freed.empty() && freed.back().pos + freed.back().num_blocks == pos){
+                freed.back().num_blocks += gap_end - pos;
+            } else{
+                freed.push_back(FreeNode(gap_end - pos, pos));
+            }
+            pos = gap_end;
+        }
+    }
+    merge(start, end);
+}
+
+uint RefCounts::refs(uint block, uint *same) const{
+    lock_guard<mutex> guard(lock);
+    auto it = runs.upper_bound(block);
+    if(it != runs.begin() && prev(it)->first + prev(it)->second.length > block){
+        auto run = prev(it);
+        if(same) *same = run->first + run->second.length - block;
+        return run->second.refs;
+    }
+    if(same) *same = it == runs.end() ? UINT_MAX - block : it->first - block;
+    return 1;
+}
+
+void RefCounts::save(vector<unsigned char> &ref_map, uint num_blocks) const{
+    lock_guard<mutex> guard(lock);
+    std::fill(ref_map.begin(), ref_map.end(), 0);
+    for(auto &kv : runs){
+        uint end = min(kv.first + kv.second.length, num_blocks);
+        for(uint b = kv.first; b < end; b++) ref_map[b] = kv.second.refs - 1;
+    }
+}
+
+void RefCounts::load(const vector<unsigned char> &ref_map, uint num_blocks){
+    lock_guard<mutex> guard(lock);
+    runs.clear();
+    uint b = 0;
+    while(b < num_blocks){
+        if(ref_map[b] == 0){
+            b++;
+            continue;
+        }
+        uint start = b;
+        while(b < num_blocks && ref_map[b] == ref_map[start]) b++;
+        runs[start] = Run{b - start, ref_map[start] + 1U};
+    }
+}
+
+uint RefCounts::shared() const{
+    lock_guard<mutex> guard(lock);
+    uint total = 0;
+    for(auto &kv : runs) total += kv.second.length;
+    return total;
+}
@@ -0,0 +1,50 @@
+/*
+RefCounts tracks the data blocks that more than one inode refers to, which is what a
+copy-on-write cp leaves behind. A block it does not hold has a single owner. It keeps
+1. runs of consecutive blocks with the same reference count, keyed by their first
+   block, so sharing a file costs about one run per extent rather than one per block
+2. a lock, since inodes on different threads share and release blocks at once
+Counts stay at or below max_refs so the reference map on disk needs one byte per block.
+*/
+
+#ifndef _REFCOUNTS_H_
+#define _REFCOUNTS_H_
+
+#include "freeNode.hpp"
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <sys/types.h>
+
+class RefCounts{
+        struct Run{
+            uint length;
+            uint refs;
+        };
+
+        mutable std::mutex lock;
+        std::map<uint, Run> runs;
+
+        void split(uint block);
+        void merge(uint first, uint end);
+
+    public:
+        static const uint max_refs = 256;
+
+        //One more reference to every block of the runs. Nothing changes and false is
+        //returned if that would take a block past max_refs.
+        bool add(const std::vector<FreeNode> &blocks);
+        //one reference less to [start, start + count); blocks nobody refers to any more go to freed
+        void drop(uint start, uint count, std::vector<FreeNode> &freed);
+        //references to block, and how many blocks from it on have that many too
+        uint refs(uint block, uint *same = nullptr) const;
+
+        //the reference map: a byte per block holding its references beyond the first
+        void save(std::vector<unsigned char> &ref_map, uint num_blocks) const;
+        void load(const std::vector<unsigned char> &ref_map, uint num_blocks);
+        //blocks with more than one reference
+        uint shared() const;
+};
+
+#endif
@@ -0,0 +1,42 @@
+/*
+RWLock is a reader/writer lock (C++11 has no std::shared_mutex) wrapping a
+pthread_rwlock_t. ReadGuard and WriteGuard hold it for the lifetime of a scope.
+*/
+
+#ifndef _RWLOCK_H_
+#define _RWLOCK_H_
+
+#include <pthread.h>
+
+class RWLock{
+        pthread_rwlock_t rwlock;
+    public:
+        RWLock() { pthread_rwlock_init(&rwlock, nullptr); }
+        ~RWLock() { pthread_rwlock_destroy(&rwlock); }
+        RWLock(const RWLock &) = delete;
+        RWLock &operator=(const RWLock &) = delete;
+
+        void lock_shared() { pthread_rwlock_rdlock(&rwlock); }
+        void lock() { pthread_rwlock_wrlock(&rwlock); }
+        void unlock() { pthread_rwlock_unlock(&rwlock); }
+};
+
+class ReadGuard{
+        RWLock &rw;
+    public:
+        explicit ReadGuard(RWLock &rw) : rw(rw) { rw.lock_shared(); }
+        ~ReadGuard() { rw.unlock(); }
+        ReadGuard(const ReadGuard &) = delete;
+        ReadGuard &operator=(const ReadGuard &) = delete;
+};
+
+class WriteGuard{
+        RWLock &rw;
+    public:
+        explicit WriteGuard(RWLock &rw) : rw(rw) { rw.lock(); }
+        ~WriteGuard() { rw.unlock(); }
+        WriteGuard(const WriteGuard &) = delete;
+        WriteGuard &operator=(const WriteGuard &) = delete;
+};
+
+#endif
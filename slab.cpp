@@ -0,0 +1,70 @@
+#include "slab.hpp"
+
+#include <algorithm>
+#include <new>
+
+using std::lock_guard;
+using std::max;
+using std::mutex;
+
+Slab::Slab(uint slots_per_chunk)
+    :slots_per_chunk(max(slots_per_chunk, 1U)),
+     slot_size(0),
+     free_slots(nullptr){}
+
+Slab::~Slab(){
+    for(char *chunk : chunks){
+        ::operator delete(chunk);
+    }
+}
+
+//carve a new chunk into slots and put them all on the free list
+void Slab::grow(){
+    char *chunk = static_cast<char *>(::operator new(slot_size * slots_per_chunk));
+    chunks.push_back(chunk);
+    for(uint s = slots_per_chunk; s > 0; s--){
+        FreeSlot *slot = reinterpret_cast<FreeSlot *>(chunk + (s - 1) * slot_size);
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+    counters.slots += slots_per_chunk;
+}
+
+void *Slab::allocate(size_t size){
+    lock_guard<mutex> guard(lock);
+    if(slot_size == 0){
+        //keep every slot aligned for any object, and big enough to hold a free list link
+        const size_t align = alignof(std::max_align_t);
+        slot_size = (max(size, sizeof(FreeSlot)) + align - 1) / align * align;
+        counters.slot_size = slot_size;
+    }
+    if(size > slot_size){
+        counters.large++;
+        return ::operator new(size);
+    }
+
+    if(free_slots == nullptr) grow();
+    FreeSlot *slot = free_slots;
+    free_slots = slot->next;
+    counters.used++;
+    return slot;
+}
+
+void Slab::deallocate(void *p, size_t size){
+    lock_guard<mutex> guard(lock);
+    if(size > slot_size){
+        counters.large--;
+        ::operator delete(p);
+        return;
+    }
+
+    FreeSlot *slot = static_cast<FreeSlot *>(p);
+    slot->next = free_slots;
+    free_slots = slot;
+    counters.used--;
+}
+
+Slab::Stats Slab::stats(){
+    lock_guard<mutex> guard(lock);
+    return counters;
+}
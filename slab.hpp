@@ -0,0 +1,77 @@
+/*
+A Slab hands out equal sized slots carved from large chunks, for the objects the file
+system keeps one of per name or per file: directory entries, inodes and the links
+from a directory to its entries. It contains
+1. chunks of slots_per_chunk slots, allocated as they are needed and kept until the
+   Slab goes, so a million small objects cost a few hundred allocations
+2. a free list threaded through the free slots: allocating and freeing are O(1) and a
+   slot carries no header of its own
+3. the slot size, fixed by the first request: std::allocate_shared and std::list ask
+   for node types only the library knows the size of; anything larger goes to operator new
+4. counters of slots in use and slots in the chunks, for the memory report
+A lock guards it, so slots can be taken and given back from any thread.
+SlabAllocator is a standard allocator drawing from a Slab, for the containers and
+shared pointers that hold those objects.
+*/
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <sys/types.h>
+
+class Slab{
+    public:
+        struct Stats{
+            size_t slot_size = 0;
+            unsigned long used = 0;     //slots handed out
+            unsigned long slots = 0;    //slots in all chunks
+            unsigned long large = 0;    //live requests bigger than a slot, passed to operator new
+        };
+
+        explicit Slab(uint slots_per_chunk = 1024);
+        ~Slab();
+        Slab(const Slab &) = delete;
+        Slab &operator=(const Slab &) = delete;
+
+        void *allocate(size_t size);
+        void deallocate(void *p, size_t size);
+        Stats stats();
+
+    private:
+        struct FreeSlot{
+            FreeSlot *next;
+        };
+
+        const uint slots_per_chunk;
+        std::mutex lock;
+        size_t slot_size;
+        FreeSlot *free_slots;
+        std::vector<char *> chunks;
+        Stats counters;
+
+        void grow();
+};
+
+template <typename T>
+class SlabAllocator{
+    public:
+        typedef T value_type;
+        Slab *slab;
+
+        explicit SlabAllocator(Slab &slab) : slab(&slab) {}
+        template <typename U>
+        SlabAllocator(const SlabAllocator<U> &other) : slab(other.slab) {}
+
+        T *allocate(size_t n) { return static_cast<T *>(slab->allocate(n * sizeof(T))); }
+        void deallocate(T *p, size_t n) { slab->deallocate(p, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const SlabAllocator<T> &a, const SlabAllocator<U> &b) { return a.slab == b.slab; }
+template <typename T, typename U>
+bool operator!=(const SlabAllocator<T> &a, const SlabAllocator<U> &b) { return a.slab != b.slab; }
+
+#endif
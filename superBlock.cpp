@@ -0,0 +1,968 @@
+#include "superBlock.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+using std::fill;
+using std::lock_guard;
+using std::map;
+using std::max;
+using std::min;
+using std::mutex;
+using std::pair;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+struct SuperBlock::DiskSuper{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint32_t num_inodes;
+    uint32_t journal_blocks;
+    uint32_t clean;
+    uint32_t tail_hint;         //a tail block with free units, 0 if none is known
+};
+
+struct SuperBlock::DiskExtent{
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t length;
+};
+
+struct SuperBlock::DiskInode{
+    uint32_t type;              //0 free, 1 file, 2 directory
+    uint32_t links;
+    uint32_t size;
+    uint32_t blocks_used;
+    uint32_t extent_count;
+    uint32_t extent_next;       //first extent block, 0 if every extent is inline
+    uint32_t packed;            //0, packed_inline or packed_tail for a file without extents
+    uint32_t tail_block;        //tail block holding a packed_tail file's bytes
+    union{
+        DiskExtent extents[inline_extents];
+        char data[SuperBlock::inline_bytes];    //a packed_inline file's bytes
+        uint32_t tail_unit;                     //first unit of a packed_tail file's fragment
+    };
+};
+static_assert(sizeof(SuperBlock::DiskInode) == 128, "inode records are 128 bytes");
+static_assert(sizeof(SuperBlock::DiskExtent) * 8 == SuperBlock::inline_bytes, "inline data fills the inline extents");
+
+//header of a tail block, followed by a bitmap of its units; header and bitmap take the
+//first units themselves
+struct SuperBlock::DiskTail{
+    uint32_t magic;
+    uint32_t used;              //units taken, the header's own included
+};
+
+//header of an extent block, followed by as many extents as fit
+struct SuperBlock::DiskExtentBlock{
+    uint32_t next;
+    uint32_t count;
+};
+
+struct SuperBlock::DiskDirent{
+    uint32_t ino;               //0 once the name is removed
+    uint16_t rec_len;
+    uint8_t type;
+    uint8_t name_len;
+};
+
+const uint SuperBlock::inline_extents;
+const uint SuperBlock::inline_bytes;
+const uint SuperBlock::tail_unit;
+
+namespace {
+
+const uint file_type = 1;
+const uint dir_type = 2;
+const uint packed_inline = 1;
+const uint packed_tail = 2;
+const uint tail_magic = 0x5441494c;     //"TAIL"
+
+uint div_up(uint a, uint b){
+    return (a + b - 1) / b;
+}
+
+bool test_bit(const vector<unsigned char> &map, uint bit){
+    return map[bit / 8] & (1 << (bit % 8));
+}
+
+void set_bit(vector<unsigned char> &map, uint bit, bool on){
+    if(on) map[bit / 8] |= 1 << (bit % 8);
+    else map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+}
+
+SuperBlock::SuperBlock(BlockCache &block_cache, Journal &journal, Allocator &allocator,
+                       const uint block_size, const uint num_blocks)
+    :block_cache(block_cache),
+     journal(journal),
+     allocator(allocator),
+     block_size(block_size),
+     num_blocks(num_blocks),
+     num_inodes(0),
+     journal_blocks(0),
+     next_ino(root_ino + 1),
+     used_inodes(0){}
+
+//place the three maps, the inode table and the journal after the superblock for num_inodes inodes
+void SuperBlock::lay_out(){
+    uint per_block = block_size / sizeof(DiskInode);
+    itable_blocks = div_up(num_inodes, per_block);
+    num_inodes = itable_blocks * per_block;
+
+    imap_start = 1;
+    imap_blocks = div_up(div_up(num_inodes, 8), block_size);
+    bmap_start = imap_start + imap_blocks;
+    bmap_blocks = div_up(div_up(num_blocks, 8), block_size);
+    rmap_start = bmap_start + bmap_blocks;
+    rmap_blocks = div_up(num_blocks, block_size);
+    itable_start = rmap_start + rmap_blocks;
+    journal_start = itable_start + itable_blocks;
+    data_start = journal_start + journal_blocks;
+}
+
+void SuperBlock::write_super(bool clean){
+    uint hint;
+    {
+        lock_guard<mutex> guard(tail_lock);
+        hint = partial_tails.empty() ? 0 : *partial_tails.begin();
+    }
+    vector<char> block(block_size);
+    DiskSuper super = {magic, version, block_size, num_blocks, num_inodes, journal_blocks, clean, hint};
+    memcpy(block.data(), &super, sizeof(super));
+    block_cache.write(0, block.data(), block_size);
+}
+
+off_t SuperBlock::inode_pos(uint ino) const{
+    return static_cast<off_t>(itable_start) * block_size + static_cast<off_t>(ino) * sizeof(DiskInode);
+}
+
+void SuperBlock::format(){
+    num_inodes = max(num_blocks / blocks_per_inode, 2 * root_ino);
+    journal_blocks = Journal::size_for(num_blocks);
+    lay_out();
+
+    inode_map.assign(imap_blocks * block_size, 0);
+    set_bit(inode_map, 0, true);    //inode 0 means "no inode" in directory records
+    used_inodes = 0;
+    next_ino = root_ino + 1;
+    live.clear();
+    partial_tails.clear();
+    refs.load(vector<unsigned char>(num_blocks), num_blocks);
+
+    //A fresh image is one big hole. A reformat punches out everything after the maps,
+    //which clears the inode table at once; a device that cannot gets it zeroed.
+    if(!block_cache.discard(itable_start, num_blocks - itable_start)){
+        vector<char> zeroes(block_size);
+        for(uint b = itable_start; b < journal_start; b++){
+            block_cache.write(static_cast<off_t>(b) * block_size, zeroes.data(), block_size, true);
+        }
+    }
+    allocator.reserve(0, data_start);
+    journal.format(journal_start, journal_blocks);
+
+    auto root = Inode::create(root_ino, true);
+    root->links = 1;
+    set_bit(inode_map, root_ino, true);
+    used_inodes++;
+    write_inode(*root);
+
+    //the new layout is on the image before anything is logged against it
+    write_super(false);
+    flush();
+    block_cache.sync();
+    journal.commit();
+}
+
+bool SuperBlock::mount(){
+    vector<char> block(block_size);
+    block_cache.read(0, block.data(), block_size);
+    DiskSuper super;
+    memcpy(&super, block.data(), sizeof(super));
+    if(super.magic != magic || super.version != version
+       || super.block_size != block_size || super.num_blocks != num_blocks){
+        return false;
+    }
+
+    num_inodes = super.num_inodes;
+    journal_blocks = super.journal_blocks;
+    lay_out();
+    live.clear();
+    partial_tails.clear();
+    journal.replay(journal_start, journal_blocks);
+
+    if(super.clean){
+        inode_map.resize(imap_blocks * block_size);
+        block_cache.read(static_cast<off_t>(imap_start) * block_size,
+                         reinterpret_cast<char *>(inode_map.data()), inode_map.size());
+        used_inodes = 0;
+        for(uint ino = root_ino; ino < num_inodes; ino++){
+            if(test_bit(inode_map, ino)) used_inodes++;
+        }
+
+        vector<unsigned char> block_map(bmap_blocks * block_size);
+        block_cache.read(static_cast<off_t>(bmap_start) * block_size,
+                         reinterpret_cast<char *>(block_map.data()), block_map.size());
+        reserve_used(block_map);
+
+        vector<unsigned char> ref_map(rmap_blocks * block_size);
+        block_cache.read(static_cast<off_t>(rmap_start) * block_size,
+                         reinterpret_cast<char *>(ref_map.data()), ref_map.size());
+        refs.load(ref_map, num_blocks);
+        if(super.tail_hint != 0) partial_tails.insert(super.tail_hint);
+    } else{
+        rebuild();
+    }
+
+    //until the next clean unmount the maps on the image may lag behind,
+    //and the image must say so before anything changes
+    write_super(false);
+    block_cache.sync();
+    return true;
+}
+
+//take every run of set bits in the free map out of the allocator
+void SuperBlock::reserve_used(const vector<unsigned char> &block_map){
+    uint b = 0;
+    while(b < num_blocks){
+        if(block_map[b / 8] == 0 && b % 8 == 0){
+            b += 8;
+            continue;
+        }
+        if(!test_bit(block_map, b)){
+            b++;
+            continue;
+        }
+        uint start = b;
+        while(b < num_blocks && test_bit(block_map, b)) b++;
+        allocator.reserve(start, b - start);
+    }
+}
+
+//Recover the maps after an unclean unmount: every inode record in use claims its
+//number, its data blocks, its extent blocks and its tail block. A data block claimed
+//by several records is shared. Every tail block found may have free units.
+void SuperBlock::rebuild(){
+    inode_map.assign(imap_blocks * block_size, 0);
+    set_bit(inode_map, 0, true);
+    used_inodes = 0;
+    allocator.reserve(0, data_start);
+    vector<uint> claims(num_blocks, 0);
+
+    vector<char> table(block_size);
+    uint per_block = block_size / sizeof(DiskInode);
+    for(uint b = 0; b < itable_blocks; b++){
+        journal.read(static_cast<off_t>(itable_start + b) * block_size, table.data(), block_size);
+        for(uint i = 0; i < per_block; i++){
+            DiskInode rec;
+            memcpy(&rec, table.data() + i * sizeof(DiskInode), sizeof(rec));
+            uint ino = b * per_block + i;
+            if(rec.type == 0 || ino < root_ino) continue;
+
+            set_bit(inode_map, ino, true);
+            used_inodes++;
+            map<uint, Inode::Extent> extents;
+            vector<uint> chain;
+            read_extents(rec, extents, chain);
+            for(auto &kv : extents){
+                for(uint b = kv.second.physical; b < kv.second.physical + kv.second.length; b++) claims[b]++;
+            }
+            for(uint eb : chain){
+                allocator.reserve(eb, 1);
+            }
+            //a tail block is claimed once, however many files it packs
+            if(rec.packed == packed_tail && partial_tails.insert(rec.tail_block).second){
+                allocator.reserve(rec.tail_block, 1);
+            }
+        }
+    }
+
+    vector<unsigned char> ref_map(num_blocks, 0);
+    uint b = data_start;
+    while(b < num_blocks){
+        if(claims[b] == 0){
+            b++;
+            continue;
+        }
+        uint start = b;
+        for(; b < num_blocks && claims[b] > 0; b++){
+            ref_map[b] = min(claims[b], static_cast<uint>(RefCounts::max_refs)) - 1;
+        }
+        allocator.reserve(start, b - start);
+    }
+    refs.load(ref_map, num_blocks);
+}
+
+void SuperBlock::flush(){
+    vector<unsigned char> imap;
+    {
+        lock_guard<mutex> guard(lock);
+        imap = inode_map;
+    }
+    block_cache.write(static_cast<off_t>(imap_start) * block_size,
+                      reinterpret_cast<const char *>(imap.data()), imap.size());
+
+    //everything is in use except the allocator's free runs
+    vector<unsigned char> block_map(bmap_blocks * block_size, 0xff);
+    vector<FreeNode> runs;
+    allocator.free_runs(runs);
+    for(auto &run : runs){
+        for(uint b = run.pos; b < run.pos + run.num_blocks; b++){
+            set_bit(block_map, b, false);
+        }
+    }
+    block_cache.write(static_cast<off_t>(bmap_start) * block_size,
+                      reinterpret_cast<const char *>(block_map.data()), block_map.size());
+
+    vector<unsigned char> ref_map(rmap_blocks * block_size);
+    refs.save(ref_map, num_blocks);
+    block_cache.write(static_cast<off_t>(rmap_start) * block_size,
+                      reinterpret_cast<const char *>(ref_map.data()), ref_map.size());
+}
+
+void SuperBlock::unmount(){
+    flush();
+    journal.stop();
+    write_super(true);
+}
+
+shared_ptr<Inode> SuperBlock::new_inode(bool is_dir){
+    uint ino = 0;
+    {
+        lock_guard<mutex> guard(lock);
+        uint first = root_ino + 1;
+        uint range = num_inodes - first;
+        for(uint i = 0; i < range && ino == 0; i++){
+            uint candidate = first + (next_ino - first + i) % range;
+            if(!test_bit(inode_map, candidate)) ino = candidate;
+        }
+        if(ino == 0) return nullptr;
+        set_bit(inode_map, ino, true);
+        used_inodes++;
+        next_ino = ino + 1 < num_inodes ? ino + 1 : first;
+    }
+
+    auto inode = Inode::create(ino, is_dir);
+    {
+        lock_guard<mutex> guard(lock);
+        live[ino] = inode;
+    }
+    write_inode(*inode);
+    return inode;
+}
+
+shared_ptr<Inode> SuperBlock::get_inode(uint ino){
+    lock_guard<mutex> guard(lock);
+    auto it = live.find(ino);
+    if(it != live.end()){
+        auto inode = it->second.lock();
+        if(inode) return inode;
+    }
+
+    DiskInode rec;
+    journal.read(inode_pos(ino), reinterpret_cast<char *>(&rec), sizeof(rec));
+    auto inode = Inode::create(ino, rec.type == dir_type);
+    inode->links = rec.links;
+    inode->size = rec.size;
+    inode->blocks_used = rec.blocks_used;
+    read_extents(rec, inode->extents, inode->extent_blocks);
+    if(rec.packed != 0){
+        inode->packed.reset(new Inode::Packed());
+        Inode::Packed &packed = *inode->packed;
+        if(rec.packed == packed_tail){
+            packed.tail_block = rec.tail_block;
+            packed.tail_unit = rec.tail_unit;
+            packed.tail_units = div_up(rec.size, tail_unit);
+            packed.data.resize(rec.size);
+            journal.read(static_cast<off_t>(packed.tail_block) * block_size + packed.tail_unit * tail_unit,
+                         packed.data.data(), rec.size);
+        } else{
+            packed.data.assign(rec.data, rec.data + min(static_cast<uint>(rec.size), inline_bytes));
+        }
+    }
+
+    live[ino] = inode;
+    return inode;
+}
+
+//the extents in the record, then those in its chain of extent blocks
+void SuperBlock::read_extents(const DiskInode &rec, map<uint, Inode::Extent> &extents, vector<uint> &chain){
+    for(uint e = 0; e < min(static_cast<uint>(rec.extent_count), inline_extents); e++){
+        const DiskExtent &ext = rec.extents[e];
+        extents[ext.logical] = Inode::Extent{ext.logical, ext.physical, ext.length};
+    }
+
+    vector<char> block(block_size);
+    uint per_block = (block_size - sizeof(DiskExtentBlock)) / sizeof(DiskExtent);
+    uint count = rec.extent_count > inline_extents ? rec.extent_count - inline_extents : 0;
+    uint next = rec.extent_next;
+    while(next != 0 && count > 0){
+        chain.push_back(next);
+        journal.read(static_cast<off_t>(next) * block_size, block.data(), block_size);
+        DiskExtentBlock header;
+        memcpy(&header, block.data(), sizeof(header));
+        uint n = min(min(header.count, per_block), count);
+        for(uint e = 0; e < n; e++){
+            DiskExtent ext;
+            memcpy(&ext, block.data() + sizeof(header) + e * sizeof(DiskExtent), sizeof(ext));
+            extents[ext.logical] = Inode::Extent{ext.logical, ext.physical, ext.length};
+        }
+        count -= n;
+        next = header.next;
+    }
+}
+
+bool SuperBlock::write_inode(Inode &inode){
+    DiskInode rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = inode.is_dir ? dir_type : file_type;
+    rec.links = inode.links;
+    rec.size = inode.size;
+    rec.blocks_used = inode.blocks_used;
+    rec.extent_count = inode.extents.size();
+
+    //the first extents live in the record, the rest in a chain of extent blocks
+    uint per_block = (block_size - sizeof(DiskExtentBlock)) / sizeof(DiskExtent);
+    uint overflow = inode.extents.size() > inline_extents ? inode.extents.size() - inline_extents : 0;
+    uint chain = div_up(overflow, per_block);
+    if(inode.extent_blocks.size() < chain){
+        vector<FreeNode> runs;
+        if(!allocator.allocate(chain - inode.extent_blocks.size(), runs)) return false;
+        for(auto &run : runs){
+            for(uint b = run.pos; b < run.pos + run.num_blocks; b++) inode.extent_blocks.push_back(b);
+        }
+    }
+    while(inode.extent_blocks.size() > chain){
+        journal.revoke(inode.extent_blocks.back(), 1);
+        allocator.release(inode.extent_blocks.back(), 1);
+        inode.extent_blocks.pop_back();
+    }
+    rec.extent_next = chain ? inode.extent_blocks[0] : 0;
+
+    auto ext = inode.extents.begin();
+    for(uint e = 0; e < inline_extents && ext != inode.extents.end(); e++, ++ext){
+        rec.extents[e] = DiskExtent{ext->second.logical, ext->second.physical, ext->second.length};
+    }
+    if(inode.packed && inode.packed->tail_block != 0){
+        rec.packed = packed_tail;
+        rec.tail_block = inode.packed->tail_block;
+        rec.tail_unit = inode.packed->tail_unit;
+    } else if(inode.packed){
+        rec.packed = packed_inline;
+        memcpy(rec.data, inode.packed->data.data(), inode.packed->data.size());
+    }
+
+    vector<char> block(chain ? block_size : 0);
+    for(uint c = 0; c < chain; c++){
+        fill(block.begin(), block.end(), 0);
+        uint n = 0;
+        for(; n < per_block && ext != inode.extents.end(); n++, ++ext){
+            DiskExtent disk = {ext->second.logical, ext->second.physical, ext->second.length};
+            memcpy(block.data() + sizeof(DiskExtentBlock) + n * sizeof(DiskExtent), &disk, sizeof(disk));
+        }
+        DiskExtentBlock header = {c + 1 < chain ? inode.extent_blocks[c + 1] : 0, n};
+        memcpy(block.data(), &header, sizeof(header));
+        journal.write(static_cast<off_t>(inode.extent_blocks[c]) * block_size, block.data(), block_size, true);
+    }
+
+    journal.write(inode_pos(inode.ino), reinterpret_cast<const char *>(&rec), sizeof(rec));
+    return true;
+}
+
+void SuperBlock::release_inode(Inode &inode){
+    //this runs wherever the last reference drops, perhaps under other locks
+    Journal::Op op(journal, false);
+    lock_guard<mutex> guard(lock);
+    auto it = live.find(inode.ino);
+    if(it != live.end() && it->second.expired()) live.erase(it);
+    if(inode.links > 0) return;
+
+    //only directory blocks and extent blocks were ever logged; shared blocks stay with
+    //the other inodes
+    for(auto &kv : inode.extents){
+        if(inode.is_dir){
+            journal.revoke(kv.second.physical, kv.second.length);
+            allocator.release(kv.second.physical, kv.second.length);
+            continue;
+        }
+        vector<FreeNode> freed;
+        refs.drop(kv.second.physical, kv.second.length, freed);
+        for(auto &run : freed){
+            free_data(run.pos, run.num_blocks);
+        }
+    }
+    for(uint eb : inode.extent_blocks){
+        journal.revoke(eb, 1);
+        allocator.release(eb, 1);
+    }
+    if(inode.packed && inode.packed->tail_block != 0){
+        free_tail(inode.packed->tail_block, inode.packed->tail_unit, inode.packed->tail_units);
+    }
+
+    DiskInode rec;
+    memset(&rec, 0, sizeof(rec));
+    journal.write(inode_pos(inode.ino), reinterpret_cast<const char *>(&rec), sizeof(rec));
+    set_bit(inode_map, inode.ino, false);
+    used_inodes--;
+}
+
+//File data is never logged, so its blocks go back to the host as soon as they are free.
+//Metadata blocks are not punched: until the operation freeing them commits, a crash
+//would bring them back.
+void SuperBlock::free_data(uint start, uint count){
+    block_cache.discard(start, count);
+    allocator.release(start, count);
+}
+
+bool SuperBlock::share(Inode &src, Inode &dst){
+    if(src.ino == dst.ino || src.is_dir || dst.is_dir) return false;
+    //a fixed order keeps two crossed copies from deadlocking
+    bool src_first = src.ino < dst.ino;
+    if(src_first) src.lock.lock_shared();
+    dst.lock.lock();
+    if(!src_first) src.lock.lock_shared();
+
+    bool shared = false;
+    if(dst.blocks_used == 0 && dst.extents.empty() && !dst.packed && src.packed){
+        //a packed file is small enough to simply copy
+        shared = write_packed(dst, 0, src.packed->data.data(), src.size);
+    } else if(dst.blocks_used == 0 && dst.extents.empty() && !dst.packed){
+        vector<FreeNode> blocks;
+        for(auto &kv : src.extents){
+            blocks.push_back(FreeNode(kv.second.length, kv.second.physical));
+        }
+        if(refs.add(blocks)){
+            dst.extents = src.extents;
+            dst.size = src.size;
+            dst.blocks_used = src.blocks_used;
+            shared = write_inode(dst);
+            if(!shared){
+                vector<FreeNode> freed;
+                for(auto &b : blocks) refs.drop(b.pos, b.num_blocks, freed);
+                dst.extents.clear();
+                dst.size = 0;
+                dst.blocks_used = 0;
+            }
+        }
+    }
+
+    src.lock.unlock();
+    dst.lock.unlock();
+    return shared;
+}
+
+bool SuperBlock::unshare(Inode &inode, uint pos, uint len){
+    uint first = pos / block_size;
+    uint end = min(div_up(pos + len, block_size), inode.end_block());
+    uint lblock = first;
+    while(lblock < end){
+        uint contiguous;
+        uint physical = inode.map_block(lblock, &contiguous);
+        if(physical == Inode::hole){
+            lblock += min(contiguous, end - lblock);
+            continue;
+        }
+        uint same;
+        uint count = refs.refs(physical, &same);
+        uint run = min(min(contiguous, same), end - lblock);
+        if(count == 1){
+            lblock += run;
+            continue;
+        }
+
+        //the run gets blocks of its own; only blocks the write leaves partly alone are copied
+        vector<FreeNode> fresh;
+        if(!allocator.allocate(run, fresh, inode.goal_for(lblock))) return false;
+        vector<char> block(block_size);
+        uint done = 0;
+        for(auto &piece : fresh){
+            for(uint b = 0; b < piece.num_blocks; b++, done++){
+                off_t block_start = static_cast<off_t>(lblock + done) * block_size;
+                if(block_start >= pos && block_start + block_size <= static_cast<off_t>(pos) + len) continue;
+                block_cache.read(static_cast<off_t>(physical + done) * block_size, block.data(), block_size);
+                block_cache.write(static_cast<off_t>(piece.pos + b) * block_size, block.data(), block_size, true);
+            }
+        }
+        done = 0;
+        for(auto &piece : fresh){
+            inode.remap(lblock + done, piece.num_blocks, piece.pos);
+            done += piece.num_blocks;
+        }
+
+        vector<FreeNode> freed;
+        refs.drop(physical, run, freed);
+        for(auto &f : freed){
+            free_data(f.pos, f.num_blocks);
+        }
+        lblock += run;
+    }
+    return true;
+}
+
+bool SuperBlock::fill_holes(Inode &inode, uint first, uint end, vector<pair<uint, uint> > &filled){
+    filled.clear();
+    uint needed = 0;
+    for(uint lblock = first; lblock < end;){
+        uint contiguous;
+        bool in_hole = inode.map_block(lblock, &contiguous) == Inode::hole;
+        uint run = min(contiguous, end - lblock);
+        if(in_hole){
+            filled.emplace_back(lblock, run);
+            needed += run;
+        }
+        lblock += run;
+    }
+    if(needed == 0) return true;
+
+    //each hole is placed where the blocks before it would carry on
+    vector<FreeNode> runs;
+    for(auto &h : filled){
+        if(!allocator.allocate(h.second, runs, inode.goal_for(h.first))){
+            for(auto &r : runs) allocator.release(r.pos, r.num_blocks);
+            filled.clear();
+            return false;
+        }
+    }
+
+    //deal the allocated runs out to the holes in order
+    auto run = runs.begin();
+    uint used = 0;
+    for(auto &h : filled){
+        uint lblock = h.first;
+        uint left = h.second;
+        while(left > 0){
+            uint piece = min(left, run->num_blocks - used);
+            inode.remap(lblock, piece, run->pos + used);
+            lblock += piece;
+            left -= piece;
+            used += piece;
+            if(used == run->num_blocks){
+                ++run;
+                used = 0;
+            }
+        }
+    }
+    return true;
+}
+
+bool SuperBlock::preallocate(Inode &inode, uint first, uint end){
+    vector<pair<uint, uint> > filled;
+    if(!fill_holes(inode, first, end, filled)) return false;
+
+    //the new blocks must read as zeroes, like the holes they replace
+    vector<char> zeroes;
+    for(auto &h : filled){
+        for(uint lblock = h.first; lblock < h.first + h.second;){
+            uint contiguous;
+            uint physical = inode.map_block(lblock, &contiguous);
+            uint run = min(contiguous, h.first + h.second - lblock);
+            if(!block_cache.discard(physical, run)){
+                zeroes.resize(block_size);
+                for(uint b = physical; b < physical + run; b++){
+                    block_cache.write(static_cast<off_t>(b) * block_size, zeroes.data(), block_size, true);
+                }
+            }
+            lblock += run;
+        }
+    }
+    return true;
+}
+
+uint SuperBlock::shared_blocks(const Inode &inode){
+    uint total = 0;
+    for(auto &kv : inode.extents){
+        uint b = kv.second.physical;
+        uint end = b + kv.second.length;
+        while(b < end){
+            uint same;
+            uint count = refs.refs(b, &same);
+            uint run = min(same, end - b);
+            if(count > 1) total += run;
+            b += run;
+        }
+    }
+    return total;
+}
+
+//units at the start of a tail block taken by its header and bitmap
+uint SuperBlock::tail_header_units() const{
+    return div_up(sizeof(DiskTail) + div_up(block_size / tail_unit, 8), tail_unit);
+}
+
+//Find units free consecutive units in a tail block with room, or start a new tail block
+//near goal. Only a few known partial blocks are tried before a new one is started.
+bool SuperBlock::alloc_tail(uint units, uint goal, uint &block, uint &unit){
+    const uint per_block = block_size / tail_unit;
+    const uint header_len = tail_header_units() * tail_unit;
+    const uint tries = 8;
+    vector<unsigned char> header(header_len);
+    vector<unsigned char> bits(div_up(per_block, 8));
+    DiskTail tail;
+
+    lock_guard<mutex> guard(tail_lock);
+    uint tried = 0;
+    for(auto it = partial_tails.begin(); it != partial_tails.end() && tried < tries; tried++){
+        block = *it;
+        off_t pos = static_cast<off_t>(block) * block_size;
+        journal.read(pos, reinterpret_cast<char *>(header.data()), header_len);
+        memcpy(&tail, header.data(), sizeof(tail));
+        if(tail.magic != tail_magic){
+            it = partial_tails.erase(it);
+            continue;
+        }
+        memcpy(bits.data(), header.data() + sizeof(tail), bits.size());
+
+        uint run = 0;
+        for(unit = 0; unit < per_block && run < units; unit++){
+            run = test_bit(bits, unit) ? 0 : run + 1;
+        }
+        if(run < units){
+            ++it;
+            continue;
+        }
+        unit -= units;
+        for(uint u = unit; u < unit + units; u++) set_bit(bits, u, true);
+        tail.used += units;
+        memcpy(header.data(), &tail, sizeof(tail));
+        memcpy(header.data() + sizeof(tail), bits.data(), bits.size());
+        journal.write(pos, reinterpret_cast<const char *>(header.data()), header_len);
+        if(tail.used == per_block) partial_tails.erase(it);
+        return true;
+    }
+
+    vector<FreeNode> runs;
+    if(!allocator.allocate(1, runs, goal)) return false;
+    block = runs[0].pos;
+    unit = tail_header_units();
+    tail = DiskTail{tail_magic, unit + units};
+    vector<unsigned char> image(block_size, 0);
+    memcpy(image.data(), &tail, sizeof(tail));
+    fill(bits.begin(), bits.end(), 0);
+    for(uint u = 0; u < tail.used; u++) set_bit(bits, u, true);
+    memcpy(image.data() + sizeof(tail), bits.data(), bits.size());
+    journal.write(static_cast<off_t>(block) * block_size, reinterpret_cast<const char *>(image.data()), block_size, true);
+    if(tail.used < per_block) partial_tails.insert(block);
+    return true;
+}
+
+//give units back to their tail block, and the block back to the allocator once it packs nothing
+void SuperBlock::free_tail(uint block, uint unit, uint units){
+    const uint header_len = tail_header_units() * tail_unit;
+    vector<unsigned char> header(header_len);
+    vector<unsigned char> bits(div_up(block_size / tail_unit, 8));
+    DiskTail tail;
+
+    lock_guard<mutex> guard(tail_lock);
+    off_t pos = static_cast<off_t>(block) * block_size;
+    journal.read(pos, reinterpret_cast<char *>(header.data()), header_len);
+    memcpy(&tail, header.data(), sizeof(tail));
+    memcpy(bits.data(), header.data() + sizeof(tail), bits.size());
+    for(uint u = unit; u < unit + units; u++) set_bit(bits, u, false);
+    tail.used -= units;
+
+    if(tail.used <= tail_header_units()){
+        partial_tails.erase(block);
+        journal.revoke(block, 1);
+        allocator.release(block, 1);
+        return;
+    }
+    memcpy(header.data(), &tail, sizeof(tail));
+    memcpy(header.data() + sizeof(tail), bits.data(), bits.size());
+    journal.write(pos, reinterpret_cast<const char *>(header.data()), header_len);
+    partial_tails.insert(block);
+}
+
+bool SuperBlock::can_pack(const Inode &inode, uint end) const{
+    return !inode.is_dir && inode.extents.empty() && end <= tail_limit();
+}
+
+//The bytes go into the record if they fit, else into the file's fragment, which moves
+//to a bigger one as the file grows. Bytes between the old end and pos read as zeroes.
+bool SuperBlock::write_packed(Inode &inode, uint pos, const char *src, uint len){
+    uint old_size = inode.size;
+    uint end = max(old_size, pos + len);
+    Inode::Packed next = inode.packed ? *inode.packed : Inode::Packed();
+    next.data.resize(end, 0);
+    memcpy(next.data.data() + pos, src, len);
+
+    uint units = end > inline_bytes ? div_up(end, tail_unit) : 0;
+    bool moved = units > next.tail_units || (units == 0 && next.tail_units > 0);
+    if(units > next.tail_units){
+        if(!alloc_tail(units, inode.goal, next.tail_block, next.tail_unit)) return false;
+        next.tail_units = units;
+    } else if(units == 0){
+        next.tail_block = next.tail_unit = next.tail_units = 0;
+    }
+
+    if(next.tail_block != 0){
+        //a fragment that stayed put only needs the bytes that changed
+        uint from = moved ? 0 : min(pos, old_size);
+        journal.write(static_cast<off_t>(next.tail_block) * block_size + next.tail_unit * tail_unit + from,
+                      next.data.data() + from, end - from);
+    }
+    if(moved && inode.packed && inode.packed->tail_block != 0){
+        free_tail(inode.packed->tail_block, inode.packed->tail_unit, inode.packed->tail_units);
+    }
+    inode.packed.reset(new Inode::Packed(std::move(next)));
+    inode.size = end;
+    return write_inode(inode);
+}
+
+bool SuperBlock::unpack(Inode &inode){
+    if(!inode.packed) return true;
+    std::unique_ptr<Inode::Packed> packed = std::move(inode.packed);
+    vector<pair<uint, uint> > filled;
+    if(!fill_holes(inode, 0, div_up(inode.size, block_size), filled)){
+        inode.packed = std::move(packed);
+        return false;
+    }
+    for(uint pos = 0; pos < inode.size; pos += block_size){
+        uint physical = inode.map_block(pos / block_size);
+        block_cache.write(static_cast<off_t>(physical) * block_size, packed->data.data() + pos,
+                          min(block_size, inode.size - pos), true);
+    }
+    if(packed->tail_block != 0){
+        free_tail(packed->tail_block, packed->tail_unit, packed->tail_units);
+    }
+    return write_inode(inode);
+}
+
+SuperBlock::PackStats SuperBlock::pack_stats(){
+    PackStats st;
+    std::set<uint> tails;
+    vector<char> table(block_size);
+    uint per_block = block_size / sizeof(DiskInode);
+    for(uint b = 0; b < itable_blocks; b++){
+        journal.read(static_cast<off_t>(itable_start + b) * block_size, table.data(), block_size);
+        for(uint i = 0; i < per_block; i++){
+            DiskInode rec;
+            memcpy(&rec, table.data() + i * sizeof(DiskInode), sizeof(rec));
+            if(rec.type == 0 || rec.packed == 0) continue;
+            if(rec.packed == packed_tail){
+                st.tail_files++;
+                tails.insert(rec.tail_block);
+            } else{
+                st.inline_files++;
+            }
+            st.bytes += rec.size;
+            st.blocks += div_up(rec.size, block_size);
+        }
+    }
+    st.tail_blocks = tails.size();
+    return st;
+}
+
+uint SuperBlock::inodes_used(){
+    lock_guard<mutex> guard(lock);
+    return used_inodes;
+}
+
+bool SuperBlock::read_data(Inode &inode, uint pos, char *dst, uint len){
+    if(pos + len > inode.size) return false;
+    while(len > 0){
+        uint contiguous;
+        uint block = inode.map_block(pos / block_size, &contiguous);
+        uint piece = min(len, contiguous * block_size - pos % block_size);
+        journal.read(static_cast<off_t>(block) * block_size + pos % block_size, dst, piece);
+        pos += piece;
+        dst += piece;
+        len -= piece;
+    }
+    return true;
+}
+
+//write into the inode's data, allocating blocks past its end as needed
+bool SuperBlock::write_data(Inode &inode, uint pos, const char *src, uint len){
+    uint old_blocks = inode.blocks_used;
+    uint blocks = div_up(pos + len, block_size);
+    if(blocks > old_blocks){
+        vector<FreeNode> runs;
+        if(!allocator.allocate(blocks - old_blocks, runs, inode.goal_for(inode.end_block()))) return false;
+        for(auto &run : runs){
+            inode.append(run.pos, run.num_blocks);
+        }
+    }
+
+    while(len > 0){
+        uint contiguous;
+        uint block = inode.map_block(pos / block_size, &contiguous);
+        uint piece = min(len, contiguous * block_size - pos % block_size);
+        bool fresh = pos / block_size >= old_blocks;
+        if(!fresh) piece = min(piece, old_blocks * block_size - pos);
+        journal.write(static_cast<off_t>(block) * block_size + pos % block_size, src, piece, fresh);
+        pos += piece;
+        src += piece;
+        len -= piece;
+    }
+    inode.size = max(inode.size, pos);
+    return true;
+}
+
+uint SuperBlock::record_size(const string &name){
+    return (sizeof(DiskDirent) + name.size() + 3) / 4 * 4;
+}
+
+void SuperBlock::read_dir(Inode &dir, vector<DirRecord> &records){
+    ReadGuard guard(dir.lock);
+    vector<char> data(dir.size);
+    read_data(dir, 0, data.data(), dir.size);
+
+    uint pos = 0;
+    while(pos + sizeof(DiskDirent) <= data.size()){
+        DiskDirent rec;
+        memcpy(&rec, data.data() + pos, sizeof(rec));
+        if(rec.rec_len < sizeof(DiskDirent)) break;     //a damaged record; nothing after it can be trusted
+        if(rec.ino != 0){
+            records.push_back(DirRecord{rec.ino, rec.type == dir_type,
+                                        string(data.data() + pos + sizeof(rec), rec.name_len), pos});
+        }
+        pos += rec.rec_len;
+    }
+}
+
+//fill buf with the record for one name
+static void encode_record(vector<char> &buf, uint ino, bool is_dir, const string &name){
+    uint len = SuperBlock::record_size(name);
+    size_t at = buf.size();
+    buf.resize(at + len, 0);
+    SuperBlock::DiskDirent rec = {ino, static_cast<uint16_t>(len),
+                                  static_cast<uint8_t>(is_dir ? dir_type : file_type),
+                                  static_cast<uint8_t>(name.size())};
+    memcpy(buf.data() + at, &rec, sizeof(rec));
+    memcpy(buf.data() + at + sizeof(rec), name.data(), name.size());
+}
+
+bool SuperBlock::add_record(Inode &dir, uint ino, bool is_dir, const string &name, uint &offset){
+    vector<char> buf;
+    encode_record(buf, ino, is_dir, name);
+
+    WriteGuard guard(dir.lock);
+    offset = dir.size;
+    if(!write_data(dir, offset, buf.data(), buf.size())) return false;
+    return write_inode(dir);
+}
+
+void SuperBlock::clear_record(Inode &dir, uint offset){
+    const uint32_t none = 0;
+    WriteGuard guard(dir.lock);
+    write_data(dir, offset, reinterpret_cast<const char *>(&none), sizeof(none));
+}
+
+bool SuperBlock::rewrite_dir(Inode &dir, vector<DirRecord> &records){
+    vector<char> buf;
+    for(auto &rec : records){
+        rec.offset = buf.size();
+        encode_record(buf, rec.ino, rec.is_dir, rec.name);
+    }
+
+    //the directory keeps its blocks; only the size shrinks
+    WriteGuard guard(dir.lock);
+    if(!buf.empty() && !write_data(dir, 0, buf.data(), buf.size())) return false;
+    dir.size = buf.size();
+    return write_inode(dir);
+}
@@ -0,0 +1,184 @@
+/*
+The SuperBlock owns the on-disk layout of the image and moves metadata between
+the image and memory. The image is laid out as
+1. block 0: the superblock - magic, geometry, where each region starts, and whether
+   the image was unmounted cleanly
+2. the inode map: one bit per inode number, set while the inode is in use
+3. the free map: one bit per block, set while the block is in use
+4. the reference map: one byte per block counting the inodes beyond the first that
+   share it after a copy-on-write cp
+5. the inode table: a fixed size record per inode holding its type, link count,
+   size and extents; extents that do not fit in the record continue in a chain
+   of extent blocks. A file of up to inline_bytes keeps its bytes in the record
+   instead of extents
+6. the journal: inode table, extent and directory blocks are changed through it, so a
+   group of operations reaches the image as one sequential append
+7. data blocks: file contents and directory blocks. A directory's data is a list
+   of records (inode number, type, name); removing a name zeroes the inode number
+   of its record and the directory is compacted once half of it is dead.
+   Tail blocks pack the bytes of files too big for their record but no bigger than
+   half a block: a header marks which tail_unit sized units are taken, and each such
+   file holds a run of units. Tail blocks are changed through the journal.
+Mounting only reads the superblock and the maps. Inodes are read when a
+directory holding them is first loaded and directories are loaded on first use,
+so mount time does not depend on how many files the image holds.
+An image that was not unmounted cleanly has its journal replayed and then its maps
+rebuilt from the inode table; the maps themselves are only written on flush.
+*/
+
+#ifndef _SUPERBLOCK_H_
+#define _SUPERBLOCK_H_
+
+#include "allocator.hpp"
+#include "blockCache.hpp"
+#include "inode.hpp"
+#include "journal.hpp"
+#include "refCounts.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+class SuperBlock{
+    public:
+        static const uint root_ino = 1;
+        static const uint max_name = 255;
+        //files up to inline_bytes are packed into their inode record, files up to
+        //tail_limit() into a fragment of a tail block
+        static const uint inline_bytes = 96;
+        static const uint tail_unit = 32;
+
+        //one live name in a directory block
+        struct DirRecord{
+            uint ino;
+            bool is_dir;
+            std::string name;
+            uint offset;        //byte offset of the record in the directory's data
+        };
+
+        SuperBlock(BlockCache &block_cache, Journal &journal, Allocator &allocator, const uint block_size, const uint num_blocks);
+
+        //Mount the file system on the image: false if the image holds none with this geometry.
+        //Every block in use is taken out of the allocator.
+        bool mount();
+        //lay out an empty file system with just the root directory
+        void format();
+        //write the inode, free and reference maps so the image matches memory
+        void flush();
+        //flush, empty the journal and mark the image clean
+        void unmount();
+
+        //a new inode with no links; it is freed when the last reference goes unless a directory links it
+        std::shared_ptr<Inode> new_inode(bool is_dir);
+        //the inode in memory, read from the inode table if nobody holds it
+        std::shared_ptr<Inode> get_inode(uint ino);
+        //write the inode's record (and extent chain); the caller holds its lock
+        bool write_inode(Inode &inode);
+        //the inode is leaving memory; if its last link is gone its number and the blocks
+        //nobody else shares are freed
+        void release_inode(Inode &inode);
+
+        //Give the empty inode dst the blocks of src, shared until either side writes them,
+        //or a copy of src's bytes if it is packed; locks both. False if dst is not empty or
+        //the blocks cannot take another reference.
+        bool share(Inode &src, Inode &dst);
+        //give the blocks holding bytes [pos, pos + len) of the inode copies of their own if they
+        //are shared, keeping the bytes outside the range; the caller holds the inode's lock
+        bool unshare(Inode &inode, uint pos, uint len);
+        //Allocate blocks for the holes among logical blocks [first, end) of the inode, which
+        //the caller holds locked; filled gets the runs (first block, length) that were holes.
+        //False, with nothing allocated, if the space runs out.
+        bool fill_holes(Inode &inode, uint first, uint end, std::vector<std::pair<uint, uint> > &filled);
+        //fill_holes, and make the new blocks read as zeroes
+        bool preallocate(Inode &inode, uint first, uint end);
+        //how many of the inode's blocks are shared; the caller holds its lock
+        uint shared_blocks(const Inode &inode);
+
+        //Small files, on inodes the caller holds locked. A file with no extents whose
+        //bytes end at or before tail_limit() is packed by write_packed; false if there is no
+        //room for its fragment, and the file is left as it was.
+        uint tail_limit() const { return block_size / 2; }
+        bool can_pack(const Inode &inode, uint end) const;
+        bool write_packed(Inode &inode, uint pos, const char *src, uint len);
+        //give a packed file a block of its own for its bytes
+        bool unpack(Inode &inode);
+
+        struct PackStats{
+            uint inline_files = 0;
+            uint tail_files = 0;
+            uint tail_blocks = 0;
+            unsigned long bytes = 0;        //bytes the packed files hold
+            unsigned long blocks = 0;       //blocks they would take unpacked
+        };
+        //scan the inode table for packed files
+        PackStats pack_stats();
+
+        //directory blocks; the caller serializes changes to one directory
+        void read_dir(Inode &dir, std::vector<DirRecord> &records);
+        bool add_record(Inode &dir, uint ino, bool is_dir, const std::string &name, uint &offset);
+        void clear_record(Inode &dir, uint offset);
+        //write records back to back from the start, updating their offsets
+        bool rewrite_dir(Inode &dir, std::vector<DirRecord> &records);
+        static uint record_size(const std::string &name);
+
+        uint inodes_used();
+        uint inode_count() const { return num_inodes; }
+
+        //on-disk structures, defined with the code that reads and writes them
+        struct DiskSuper;
+        struct DiskExtent;
+        struct DiskInode;
+        struct DiskExtentBlock;
+        struct DiskDirent;
+        struct DiskTail;
+
+    private:
+        static const uint magic = 0x53464955;       //"UIFS"
+        static const uint version = 4;
+        static const uint blocks_per_inode = 8;
+        static const uint inline_extents = 8;       //extents held in the inode record itself
+
+        BlockCache &block_cache;
+        Journal &journal;
+        Allocator &allocator;
+        RefCounts refs;
+        const uint block_size;
+        const uint num_blocks;
+        uint num_inodes;
+        uint imap_start, imap_blocks;
+        uint bmap_start, bmap_blocks;
+        uint rmap_start, rmap_blocks;
+        uint itable_start, itable_blocks;
+        uint journal_start, journal_blocks;
+        uint data_start;
+
+        std::mutex lock;                                        //guards the inode map and the live table
+        std::vector<unsigned char> inode_map;
+        uint next_ino;                                          //where the search for a free inode starts
+        uint used_inodes;
+        std::unordered_map<uint, std::weak_ptr<Inode> > live;
+
+        std::mutex tail_lock;                                   //guards the tail blocks' headers
+        std::set<uint> partial_tails;                           //tail blocks known to have free units
+
+        void lay_out();
+        void write_super(bool clean);
+        off_t inode_pos(uint ino) const;
+        void read_extents(const DiskInode &rec, std::map<uint, Inode::Extent> &extents, std::vector<uint> &chain);
+        bool read_data(Inode &inode, uint pos, char *dst, uint len);
+        bool write_data(Inode &inode, uint pos, const char *src, uint len);
+        void reserve_used(const std::vector<unsigned char> &block_map);
+        void rebuild();
+        void free_data(uint start, uint count);
+        uint tail_header_units() const;
+        bool alloc_tail(uint units, uint goal, uint &block, uint &unit);
+        void free_tail(uint block, uint unit, uint units);
+};
+
+#endif